@@ -0,0 +1,259 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Frequency locked holdover discipline. Learns the CPU crystal and
+   DS3231 1 Hz errors against GPS PPS and keeps track of the time
+   error while the DS3231 is driving the clock.
+*/
+
+#include <avr/io.h>
+#include <util/atomic.h>
+#include <stdlib.h>
+#include "discipline.h"
+#include "timebase.h"
+#include "tick.h"
+#include "nmea.h"
+#include "mtk3339.h"
+#include "ds3231.h"
+
+/* Last GPS PPS edge seen */
+static uint8_t gps_seq = 0;
+static uint32_t gps_stamp = 0;
+static uint16_t gps_tick = 0;
+static uint8_t gps_have = 0;
+
+static uint16_t cpu_samples = 0;
+
+/* Last DS3231 edge seen */
+static uint8_t rtc_seq = 0;
+static uint8_t phase_valid = 0;
+static uint16_t rtc_samples = 0;
+static uint16_t tau_count = 0;
+
+/* Last timebase mark seen and the last one GPS drove */
+static uint32_t mark_seconds = 0;
+static uint32_t gps_mark_stamp = 0;
+static uint32_t gps_mark_seconds = 0;
+static uint8_t gps_mark_valid = 0;
+
+/* Holdover offset is seeded from the first DS3231 driven second */
+static uint8_t offset_valid = 0;
+static int32_t offset_frac = 0;
+
+/* Bring a tick difference into (-F_CPU/2, F_CPU/2] */
+static int32_t discipline_wrap(int32_t d) {
+    while (d > (int32_t)(F_CPU/2)) {
+        d -= F_CPU;
+    }
+    while (d <= -(int32_t)(F_CPU/2)) {
+        d += F_CPU;
+    }
+    return(d);
+}
+
+/* First order low pass, est is Q8. The step is rounded, a plain
+   shift floors it and leaves est up to a tick below the mean. */
+static void discipline_filter(int32_t *est, int32_t sample, uint16_t n) {
+    if (n == 0) {
+        *est = sample << 8;
+    } else {
+        *est += ((sample << 8) - *est + (1L << (discipline_tau - 1))) >> discipline_tau;
+    }
+}
+
+/* Lengthen tau while the DS3231 samples agree with the estimate,
+   shorten it when they jump (temperature step, RTC reset) */
+static void discipline_adapt(int32_t sample) {
+    if (labs(sample - (discipline_rtc_freq >> 8)) > DISCIPLINE_FREQ_STEP) {
+        if (discipline_tau >= DISCIPLINE_TAU_MIN + 2) {
+            discipline_tau -= 2;
+        } else {
+            discipline_tau = DISCIPLINE_TAU_MIN;
+        }
+        tau_count = 0;
+    } else if (discipline_tau < DISCIPLINE_TAU_MAX) {
+        tau_count++;
+        if (tau_count >= (1 << discipline_tau)) {
+            discipline_tau++;
+            tau_count = 0;
+        }
+    }
+}
+
+/* Keep the displayed time within (-1, 0] s of true time, i.e. show
+   the second that has started */
+static void discipline_normalize(void) {
+    while (discipline_offset > 0) {
+        discipline_offset -= F_CPU;
+        discipline_slip--;
+    }
+    while (discipline_offset <= -(int32_t)F_CPU) {
+        discipline_offset += F_CPU;
+        discipline_slip++;
+    }
+}
+
+/* One or more DS3231 driven seconds have passed in holdover */
+static void discipline_holdover_mark(uint32_t stamp, uint32_t seconds) {
+    uint32_t n = seconds - mark_seconds;
+
+    discipline_holdover += n;
+
+    if (!offset_valid) {
+        if (!gps_mark_valid || ((seconds - gps_mark_seconds) > DISCIPLINE_SEED_MAX)) {
+            return;
+        }
+        /* Displayed seconds since the last GPS edge against the
+           measured interval in GPS seconds */
+        discipline_offset = (int32_t)(seconds - gps_mark_seconds)*
+            (int32_t)(F_CPU + (discipline_cpu_freq >> 8)) -
+            (int32_t)(stamp - gps_mark_stamp);
+        offset_frac = 0;
+        offset_valid = 1;
+    } else {
+        /* A slow DS3231 second lets true time run ahead */
+        offset_frac += (int32_t)n*discipline_rtc_freq;
+        discipline_offset -= (offset_frac >> 8);
+        offset_frac &= 0xff;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        discipline_normalize();
+    }
+}
+
+void discipline_init(void) {
+    discipline_state = DISCIPLINE_UNLOCKED;
+    discipline_tau = DISCIPLINE_TAU_MIN;
+    discipline_cpu_freq = 0;
+    discipline_rtc_freq = 0;
+    discipline_phase = 0;
+    discipline_offset = 0;
+    discipline_holdover = 0;
+    discipline_slip = 0;
+
+    gps_have = 0;
+    cpu_samples = 0;
+    phase_valid = 0;
+    rtc_samples = 0;
+    tau_count = 0;
+    gps_mark_valid = 0;
+    offset_valid = 0;
+}
+
+/* Run from the main loop, picks up new edges from the PPS ISRs */
+void discipline_task(void) {
+    uint32_t gs = 0;
+    uint32_t rs = 0;
+    uint32_t ms = 0;
+    uint32_t mn = 0;
+    uint8_t gq = 0;
+    uint8_t rq = 0;
+    uint8_t msrc = 0;
+    uint8_t gps_good = 0;
+    int32_t d = 0;
+    int32_t p = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        gs = mtk3339_pps_stamp;
+        gq = mtk3339_pps_seq;
+        rs = ds3231_pps_stamp;
+        rq = ds3231_pps_seq;
+        ms = timebase_pps_stamp;
+        mn = timebase_seconds;
+        msrc = timebase_source;
+    }
+
+    /* CPU crystal from consecutive GPS edges */
+    if (gq != gps_seq) {
+        if (gps_have && gps_fix && ((uint8_t)(gq - gps_seq) == 1)) {
+            d = (int32_t)(gs - gps_stamp) - (int32_t)F_CPU;
+            if (labs(d) < DISCIPLINE_FREQ_WINDOW) {
+                discipline_filter(&discipline_cpu_freq, d, cpu_samples);
+                if (cpu_samples < 0xffff) {
+                    cpu_samples++;
+                }
+            }
+        }
+        gps_seq = gq;
+        gps_stamp = gs;
+        gps_tick = tick_ms();
+        gps_have = 1;
+    }
+
+    gps_good = gps_have && gps_fix &&
+        (tick_since(gps_tick) < DISCIPLINE_PPS_TIMEOUT_MS);
+
+    /* DS3231 from the drift of its edge against the GPS edge */
+    if (rq != rtc_seq) {
+        if (gps_good) {
+            p = discipline_wrap((int32_t)(rs - gps_stamp));
+            if (phase_valid && ((uint8_t)(rq - rtc_seq) == 1)) {
+                d = discipline_wrap(p - discipline_phase);
+                if (labs(d) < DISCIPLINE_FREQ_WINDOW) {
+                    if (rtc_samples) {
+                        discipline_adapt(d);
+                    }
+                    discipline_filter(&discipline_rtc_freq, d, rtc_samples);
+                    if (rtc_samples < 0xffff) {
+                        rtc_samples++;
+                    }
+                }
+            }
+            discipline_phase = p;
+            phase_valid = 1;
+        } else {
+            phase_valid = 0;
+        }
+        rtc_seq = rq;
+    }
+
+    switch (discipline_state) {
+    case DISCIPLINE_UNLOCKED:
+        if (gps_good) {
+            discipline_state = DISCIPLINE_TRACK;
+        }
+        break;
+    case DISCIPLINE_TRACK:
+        if (!gps_good) {
+            if (rtc_samples >= DISCIPLINE_MIN_SAMPLES) {
+                discipline_state = DISCIPLINE_HOLDOVER;
+                discipline_holdover = 0;
+                discipline_offset = 0;
+                offset_valid = 0;
+            } else {
+                discipline_state = DISCIPLINE_UNLOCKED;
+            }
+        }
+        break;
+    case DISCIPLINE_HOLDOVER:
+        if (gps_good) {
+            /* GPS sets the time again, drop anything not yet applied */
+            discipline_slip = 0;
+            discipline_state = DISCIPLINE_TRACK;
+        }
+        break;
+    }
+
+    /* Follow the edges driving the_time */
+    if (mn != mark_seconds) {
+        if (msrc == TIMEBASE_SRC_GPS) {
+            gps_mark_stamp = ms;
+            gps_mark_seconds = mn;
+            gps_mark_valid = 1;
+        } else if (discipline_state == DISCIPLINE_HOLDOVER) {
+            discipline_holdover_mark(ms, mn);
+        }
+        mark_seconds = mn;
+    }
+}
+
+/* Q8 CPU ticks per second to parts per billion */
+int32_t discipline_ppb(int32_t q8) {
+    return((q8*125)/(int32_t)(F_CPU/31250UL));
+}
+
+/* Parts per billion to Q8 CPU ticks per second */
+int32_t discipline_q8(int32_t ppb) {
+    return((ppb*(int32_t)(F_CPU/31250UL))/125);
+}
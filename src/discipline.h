@@ -0,0 +1,60 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Frequency locked holdover discipline. Learns the CPU crystal and
+   DS3231 1 Hz errors against GPS PPS and keeps track of the time
+   error while the DS3231 is driving the clock.
+*/
+
+#ifndef _DISCIPLINE_H_
+#define _DISCIPLINE_H_
+
+#include <stdint.h>
+
+#define DISCIPLINE_UNLOCKED 0
+#define DISCIPLINE_TRACK 1
+#define DISCIPLINE_HOLDOVER 2
+
+/* Filter time constant as a shift (2^tau seconds) */
+#define DISCIPLINE_TAU_MIN 2
+#define DISCIPLINE_TAU_MAX 8
+
+/* Largest frequency error sample accepted, CPU ticks per second
+   (100 ppm) */
+#define DISCIPLINE_FREQ_WINDOW (F_CPU/10000UL)
+
+/* A sample this far (CPU ticks/s) from the estimate shortens tau */
+#define DISCIPLINE_FREQ_STEP 16
+
+/* Samples before the DS3231 estimate is trusted for holdover */
+#define DISCIPLINE_MIN_SAMPLES 16
+
+/* Holdover offset is only seeded this many seconds after the last
+   GPS driven edge */
+#define DISCIPLINE_SEED_MAX 8
+
+/* GPS PPS missing for this long ends tracking */
+#define DISCIPLINE_PPS_TIMEOUT_MS 1500
+
+uint8_t discipline_state;
+uint8_t discipline_tau;
+/* Frequency errors against GPS, Q8 CPU ticks per second. Positive
+   means the second is long (the oscillator is slow). */
+int32_t discipline_cpu_freq;
+int32_t discipline_rtc_freq;
+/* DS3231 edge - GPS edge, CPU ticks */
+int32_t discipline_phase;
+/* Displayed - true time while in holdover, CPU ticks */
+int32_t discipline_offset;
+/* Seconds spent in the current (or last) holdover */
+uint16_t discipline_holdover;
+/* Seconds to insert (>0) or drop (<0), consumed by increment_time()
+   and the main loop */
+volatile int8_t discipline_slip;
+
+void discipline_init(void);
+void discipline_task(void);
+int32_t discipline_ppb(int32_t q8);
+int32_t discipline_q8(int32_t ppb);
+
+#endif
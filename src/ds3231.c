@@ -11,6 +11,10 @@
 #include <string.h>
 #include "twi_master.h"
 #include "ds3231.h"
+#include "ds3231_cal.h"
+#include "timebase.h"
+#include "spi.h"
+#include "sched.h"
 
 static const uint8_t ds3231_init_seq[] PROGMEM = {
     0x00, // seconds
@@ -34,11 +38,36 @@ static const uint8_t ds3231_init_seq[] PROGMEM = {
 
 volatile uint8_t led = 0;
 
+/* Register read in flight for the _async calls, DS3231_OP_* */
+static TWI_transaction_t ds3231_xfer;
+static uint8_t ds3231_xfer_op = 0;
+static volatile uint8_t ds3231_xfer_buf[DS3231_NREG];
+
+/* Writes queued by the _async setters, one descriptor each so time
+   and date can be queued back to back */
+static TWI_transaction_t ds3231_time_xfer;
+static volatile uint8_t ds3231_time_buf[DS3231_TIME_NREG];
+static TWI_transaction_t ds3231_date_xfer;
+static volatile uint8_t ds3231_date_buf[DS3231_DATE_NREG];
+
+/* Set by the 1 Hz edge, the main loop then refreshes the snapshot */
+static volatile uint8_t ds3231_snapshot_due = 0;
+static uint8_t ds3231_snapshot_regs[DS3231_NREG];
+
+/* INT6 always timestamps the 1 Hz edge, this selects whether it also
+   drives the_time */
+static volatile uint8_t rtc_drives_time = 0;
+
 /* decimal to binary coded decimal helper */
 static inline uint8_t dectobcd(uint8_t k) {
     return((k/10)*16 + (k%10));
 }
 
+/* binary coded decimal to decimal helper */
+static inline uint8_t bcdtodec(uint8_t k) {
+    return((k >> 4)*10 + (k & 0x0f));
+}
+
 /* Prepare the correct pins and peripherals on the at90usb1287 to
    control the ds3231 */
 void ds3231_hw_init(void) {
@@ -46,156 +75,194 @@ void ds3231_hw_init(void) {
     DDRE &= ~(1 << PE6);
     PORTE &= ~(1 << PE6);
     EICRB |= (1 << ISC61) | (1 << ISC60);
+    EIMSK |= (1 << INT6);
     ds3231_enable_int();
 }
 
-/* Enable interrupt */
+/* Let the ds3231 1 Hz line drive the clock */
 void ds3231_enable_int(void) {
-    EIMSK |= (1 << INT6);
+    rtc_drives_time = 1;
 }
 
-/* Disable interrupt */
+/* Stop the ds3231 1 Hz line driving the clock (edges are still
+   timestamped) */
 void ds3231_disable_int(void) {
-    EIMSK &= ~(1 << INT6);
+    rtc_drives_time = 0;
 }
 
 /* Initialize the DS3231 chip. TWI_init() must have been called for
    this to work. */
 uint8_t ds3231_init(void) {
     uint8_t i = 0;
-
-    while(TWI_busy){};
-
-    /* word address for config start */
-    TWI_buffer_out[0] = 0x00;
+    uint8_t buf[sizeof(ds3231_init_seq)];
 
     /* call me only after TWI_init has been called */
     for (i = 0; i < sizeof(ds3231_init_seq); i++) {
-        TWI_buffer_out[i + 1] = pgm_read_byte(&ds3231_init_seq[i]);
+        buf[i] = pgm_read_byte(&ds3231_init_seq[i]);
     }
 
-    /* write config to chip */
-    TWI_master_start_write(DS3231_ADDR, sizeof(ds3231_init_seq) + 1);
+    /* aging offset from the last calibration */
+    buf[DS3231_AGING_REG] = (uint8_t)ds3231_cal_init();
 
-    while(TWI_busy){};
-    return 0;
+    /* write config to chip, starting at the first word */
+    return(TWI_write_reg(DS3231_ADDR, 0x00, buf, sizeof(buf)));
 }
 
-/* Set ds3231 time */
-void ds3231_set_time_gps(gps_rmc_time_t time) {
-    while(TWI_busy){};
+/* Start or poll an async read of len registers from reg into
+   ds3231_xfer_buf. Only one read is in flight at a time; a different
+   op gets DS3231_ASYNC_BUSY until it is done. */
+static uint8_t ds3231_read_async(uint8_t op, uint8_t reg, uint8_t len) {
+    uint8_t status = 0;
+
+    if (ds3231_xfer_op == DS3231_OP_NONE) {
+        ds3231_xfer.addr = DS3231_ADDR;
+        ds3231_xfer.flags = TWI_FLAG_REG;
+        ds3231_xfer.reg = reg;
+        ds3231_xfer.write_bytes = 0;
+        ds3231_xfer.read_bytes = len;
+        ds3231_xfer.write_buf = NULL;
+        ds3231_xfer.read_buf = ds3231_xfer_buf;
+        ds3231_xfer.done = NULL;
+        if (!TWI_queue(&ds3231_xfer)) {
+            ds3231_xfer_op = op;
+        }
+        return(DS3231_ASYNC_BUSY);
+    }
 
-    /* word address for time set start */
-    TWI_buffer_out[0] = 0x00;
-    TWI_buffer_out[1] = dectobcd(time.seconds);
-    TWI_buffer_out[2] = dectobcd(time.minutes);
-    /* maintain 24-hour setting */
-    TWI_buffer_out[3] = (~(0xc0) & dectobcd(time.hours));
+    if (ds3231_xfer_op != op) {
+        return(DS3231_ASYNC_BUSY);
+    }
 
-    /* write (UTC) time to chip */
-    TWI_master_start_write(DS3231_ADDR, 4);
-    
-    while(TWI_busy){};
-    return;
+    status = ds3231_xfer.status;
+    if (status == TWI_TRANS_DONE) {
+        ds3231_xfer_op = DS3231_OP_NONE;
+        return(DS3231_ASYNC_DONE);
+    } else if (status == TWI_TRANS_ERROR) {
+        ds3231_xfer_op = DS3231_OP_NONE;
+        return(DS3231_ASYNC_ERROR);
+    }
+
+    return(DS3231_ASYNC_BUSY);
 }
 
-/* Set ds3231 time */
-void ds3231_set_time(nixie_time_t time) {
-    while(TWI_busy){};
+/* Get date without waiting on the bus. Call until it returns
+   DS3231_ASYNC_DONE, date is only written then. */
+uint8_t ds3231_get_date_async(nixie_date_t *date) {
+    uint8_t stat = ds3231_read_async(DS3231_OP_DATE, 0x04, DS3231_DATE_NREG);
 
-    /* word address for time set start */
-    TWI_buffer_out[0] = 0x00;
-    TWI_buffer_out[1] = dectobcd(time.seconds);
-    TWI_buffer_out[2] = dectobcd(time.minutes);
-    /* maintain 24-hour setting */
-    TWI_buffer_out[3] = (~(0xc0) & dectobcd(time.hours));
+    if (stat == DS3231_ASYNC_DONE) {
+        date->day = (ds3231_xfer_buf[0] & 0x0f) + ((ds3231_xfer_buf[0] & 0x30) >> 4)*10;
+        date->month = (ds3231_xfer_buf[1] & 0x0f) + ((ds3231_xfer_buf[1] & 0x10) >> 4)*10;
+        date->year = (ds3231_xfer_buf[2] & 0x0f) + ((ds3231_xfer_buf[2] & 0xf0) >> 4)*10;
+    }
+    return(stat);
+}
 
-    /* write (UTC) time to chip */
-    TWI_master_start_write(DS3231_ADDR, 4);
-    
-    while(TWI_busy){};
-    return;
+/* Get time digits without waiting on the bus */
+uint8_t ds3231_get_time_digits_async(nixie_time_digits_t *nix_digits) {
+    uint8_t stat = ds3231_read_async(DS3231_OP_TIME, 0x00, DS3231_TIME_NREG);
+
+    if (stat == DS3231_ASYNC_DONE) {
+        nix_digits->seconds = (ds3231_xfer_buf[0] & 0x0F);
+        nix_digits->tens_seconds = ((ds3231_xfer_buf[0] & 0x70) >> 4);
+        nix_digits->minutes = (ds3231_xfer_buf[1] & 0x0F);
+        nix_digits->tens_minutes = ((ds3231_xfer_buf[1] & 0x70) >> 4);
+        nix_digits->hours = (ds3231_xfer_buf[2] & 0x0F);
+        nix_digits->tens_hours = ((ds3231_xfer_buf[2] & 0x30) >> 4);
+    }
+    return(stat);
 }
 
-/* Set ds3231 date */
-void ds3231_set_date(gps_rmc_date_t date) {
-    while(TWI_busy){};
-
-    /* word address for time set start */
-    TWI_buffer_out[0] = 0x04;
-    /* Day code 1-7 = Sunday - Saturday */
-    // todo: add me?
-    //TWI_buffer_out[1] = (0x07 & 0x01);
-    TWI_buffer_out[1] = (0x3f & dectobcd(date.day));
-    TWI_buffer_out[2] = (0x1f & dectobcd(date.month));
-    TWI_buffer_out[3] = (dectobcd(date.year));
-
-    /* write (UTC) date to chip */
-    TWI_master_start_write(DS3231_ADDR, 4);
-
-    while(TWI_busy){};
-    return;
-}    
-
-/* Get Date */
-void ds3231_get_date(nixie_date_t *date) {
-    while(TWI_busy) {};
-
-    TWI_buffer_out[0] = 0x04;
-    TWI_master_start_write_then_read(DS3231_ADDR, 1, DS3231_DATE_NREG);
-    while(TWI_busy) {};
-
-    date->day = (TWI_buffer_in[0] & 0x0f) + ((TWI_buffer_in[0] & 0x30) >> 4)*10;
-    date->month = (TWI_buffer_in[1] & 0x0f) + ((TWI_buffer_in[1] & 0x10) >> 4)*10;
-    date->year = (TWI_buffer_in[2] & 0x0f) + ((TWI_buffer_in[2] & 0xf0) >> 4)*10;
+/* Get temperature without waiting on the bus */
+uint8_t ds3231_get_temp_async(int16_t *temp) {
+    uint8_t stat = ds3231_read_async(DS3231_OP_TEMP, 0x11, 2);
+
+    if (stat == DS3231_ASYNC_DONE) {
+        *temp = ds3231_convert_temp_q(ds3231_xfer_buf[0], ds3231_xfer_buf[1]);
+    }
+    return(stat);
 }
 
-// uint8_t ds3231_get_datetime() {
+/* Get all registers without waiting on the bus */
+uint8_t ds3231_get_registers_async(uint8_t *reg_array) {
+    uint8_t stat = ds3231_read_async(DS3231_OP_REGS, 0x00, DS3231_NREG);
 
-// }
+    if (stat == DS3231_ASYNC_DONE) {
+        memcpy(reg_array, (const void *)ds3231_xfer_buf, DS3231_NREG);
+    }
+    return(stat);
+}
 
-/* Get ds3231 time as digits */
-uint8_t ds3231_get_time_digits(nixie_time_digits_t *nix_digits) {
-    uint8_t time_reg_array[DS3231_TIME_NREG];
-    
-    if (nix_digits == NULL) {
+/* Time write still on its way? */
+static inline uint8_t ds3231_time_pending(void) {
+    return((ds3231_time_xfer.status == TWI_TRANS_QUEUED) ||
+           (ds3231_time_xfer.status == TWI_TRANS_ACTIVE));
+}
+
+/* Queue the packed BCD time in ds3231_time_buf */
+static uint8_t ds3231_queue_time(void) {
+    ds3231_time_xfer.addr = DS3231_ADDR;
+    ds3231_time_xfer.flags = TWI_FLAG_REG;
+    ds3231_time_xfer.reg = 0x00;
+    ds3231_time_xfer.write_bytes = DS3231_TIME_NREG;
+    ds3231_time_xfer.read_bytes = 0;
+    ds3231_time_xfer.write_buf = ds3231_time_buf;
+    ds3231_time_xfer.read_buf = NULL;
+    ds3231_time_xfer.done = NULL;
+    return(TWI_queue(&ds3231_time_xfer));
+}
+
+/* Queue a (UTC) time write. Returns 1 if the last one is still
+   pending. */
+uint8_t ds3231_set_time_gps_async(gps_rmc_time_t time) {
+    if (ds3231_time_pending()) {
         return 1;
     }
 
-    while(TWI_busy){};
+    ds3231_time_buf[0] = dectobcd(time.seconds);
+    ds3231_time_buf[1] = dectobcd(time.minutes);
+    /* maintain 24-hour setting */
+    ds3231_time_buf[2] = (~(0xc0) & dectobcd(time.hours));
 
-    /* word address for time registers start */
-    TWI_buffer_out[0] = 0x00;
-    TWI_master_start_write_then_read(DS3231_ADDR, 1, DS3231_TIME_NREG);
-    while(TWI_busy) {};
-    
-    memcpy(time_reg_array, (const void *)TWI_buffer_in, DS3231_TIME_NREG);
-    
-    nix_digits->seconds = (time_reg_array[0] & 0x0F);
-    nix_digits->tens_seconds = ((time_reg_array[0] & 0x70) >> 4);
-    nix_digits->minutes = (time_reg_array[1] & 0x0F);
-    nix_digits->tens_minutes = ((time_reg_array[1] & 0x70) >> 4);
-    nix_digits->hours = (time_reg_array[2] & 0x0F);
-    nix_digits->tens_hours = ((time_reg_array[2] & 0x30) >> 4);
-                           
-    return 0;
+    return(ds3231_queue_time());
 }
 
-/* Get all registers from the DS3231 and copy them to reg_array */
-uint8_t ds3231_get_registers(uint8_t *reg_array) {
-    if (reg_array == NULL) {
+/* Queue a time write from packed BCD. Returns 1 if the last one is
+   still pending. */
+uint8_t ds3231_set_time_async(nixie_time_t time) {
+    if (ds3231_time_pending()) {
         return 1;
     }
-    
-    while(TWI_busy){};
-    /* Start at first word */
-    TWI_buffer_out[0] = 0x00;
-    TWI_master_start_write_then_read(DS3231_ADDR, 1, DS3231_NREG);
-    while(TWI_busy) {};
 
-    memcpy(reg_array, (const void *)TWI_buffer_in, DS3231_NREG);
-    
-    return 0;
+    ds3231_time_buf[0] = time.seconds;
+    ds3231_time_buf[1] = time.minutes;
+    /* maintain 24-hour setting */
+    ds3231_time_buf[2] = (~(0xc0) & time.hours);
+
+    return(ds3231_queue_time());
+}
+
+/* Queue a (UTC) date write. Returns 1 if the last one is still
+   pending. */
+uint8_t ds3231_set_date_async(gps_rmc_date_t date) {
+    if ((ds3231_date_xfer.status == TWI_TRANS_QUEUED) ||
+        (ds3231_date_xfer.status == TWI_TRANS_ACTIVE)) {
+        return 1;
+    }
+
+    ds3231_date_buf[0] = (0x3f & dectobcd(date.day));
+    ds3231_date_buf[1] = (0x1f & dectobcd(date.month));
+    ds3231_date_buf[2] = (dectobcd(date.year));
+
+    ds3231_date_xfer.addr = DS3231_ADDR;
+    ds3231_date_xfer.flags = TWI_FLAG_REG;
+    ds3231_date_xfer.reg = 0x04;
+    ds3231_date_xfer.write_bytes = DS3231_DATE_NREG;
+    ds3231_date_xfer.read_bytes = 0;
+    ds3231_date_xfer.write_buf = ds3231_date_buf;
+    ds3231_date_xfer.read_buf = NULL;
+    ds3231_date_xfer.done = NULL;
+    return(TWI_queue(&ds3231_date_xfer));
 }
 
 /* Convert DS3231 register into regular integer */
@@ -212,71 +279,120 @@ static uint8_t _ds3231_get_hours(uint8_t h) {
 // TODO: Add alarm registers... do we care?
 uint8_t ds3231_print_info(char *print_buf) {
     uint8_t j = 0;
-    uint8_t reg_buf[DS3231_NREG];
-    uint8_t stat = 0;
-    char tbuf[8];
+    ds3231_snapshot_t *snap = &ds3231_snapshot;
 
-    if (print_buf == NULL) {
+    if ((print_buf == NULL) || (ds3231_snapshot_seq == 0)) {
         return 1;
     }
 
-    memset(tbuf, 0x00, sizeof(tbuf));
-
-    stat = ds3231_get_registers(reg_buf);
-    if (stat) {
-        return 1;
-    }
-    
-    j += sprintf(print_buf + j, "Seconds: %i\n", _ds3231_get_seconds(reg_buf[0]));
-    j += sprintf(print_buf + j, "Minutes: %i\n", _ds3231_get_minutes(reg_buf[1]));
-    j += sprintf(print_buf + j, "Hours: %i\n", _ds3231_get_hours(reg_buf[2]));
-    j += sprintf(print_buf + j, "Day: %i\n", reg_buf[3]);
-    j += sprintf(print_buf + j, "Date: %i\n", _ds3231_get_date(reg_buf[4]));
-    j += sprintf(print_buf + j, "Month: %i\n", _ds3231_get_hours(reg_buf[5]));
-    j += sprintf(print_buf + j, "Year: %i\n", _ds3231_get_year(reg_buf[6]));
-    j += sprintf(print_buf + j, "Control: 0x%02X\n", reg_buf[14]);
-    j += sprintf(print_buf + j, "Ctrl/Stat: 0x%02X\n", reg_buf[15]);
-    j += sprintf(print_buf + j, "Aging: 0x%02X\n", reg_buf[16]);
-    dtostrf(ds3231_convert_temp(reg_buf[17], reg_buf[18]), 7, 2, tbuf);
-    j += sprintf(print_buf + j, "Temp: %s\n", tbuf);
+    j += sprintf(print_buf + j, "Seconds: %x\n", snap->time.seconds);
+    j += sprintf(print_buf + j, "Minutes: %x\n", snap->time.minutes);
+    j += sprintf(print_buf + j, "Hours: %x\n", snap->time.hours);
+    j += sprintf(print_buf + j, "Day: %i\n", snap->day);
+    j += sprintf(print_buf + j, "Date: %i\n", snap->date.day);
+    j += sprintf(print_buf + j, "Month: %i\n", snap->date.month);
+    j += sprintf(print_buf + j, "Year: %i\n", snap->date.year);
+    j += sprintf(print_buf + j, "Control: 0x%02X\n", snap->control);
+    j += sprintf(print_buf + j, "Ctrl/Stat: 0x%02X\n", snap->status);
+    j += sprintf(print_buf + j, "Aging: 0x%02X\n", (uint8_t)snap->aging);
+    j += sprintf(print_buf + j, "Temp: ");
+    j += ds3231_format_temp(print_buf + j, snap->temp);
+    j += sprintf(print_buf + j, "\n");
     
     return 0;
 }
 
-/* Convert the two temperature registers into a float value. MSB is
-   integer temp in degrees celsius. The highest two bits of the LSB
-   are fractional temperature in quarters. */
-float ds3231_convert_temp(uint8_t msb, uint8_t lsb) {
+/* Run from the main loop: after each 1 Hz edge read registers
+   0x00-0x12 in one burst (without waiting on the bus) and decode
+   them into ds3231_snapshot */
+void ds3231_task(void) {
+    uint8_t *r = ds3231_snapshot_regs;
+    uint8_t stat = 0;
+
+    if (!ds3231_snapshot_due) {
+        return;
+    }
+
+    stat = ds3231_get_registers_async(r);
+    if (stat == DS3231_ASYNC_BUSY) {
+        return;
+    }
+    ds3231_snapshot_due = 0;
+    if (stat != DS3231_ASYNC_DONE) {
+        return;
+    }
+
+    ds3231_snapshot.time.seconds = r[0] & 0x7f;
+    ds3231_snapshot.time.minutes = r[1] & 0x7f;
+    ds3231_snapshot.time.hours = r[2] & 0x3f;
+    ds3231_snapshot.day = r[3] & 0x07;
+    ds3231_snapshot.date.day = bcdtodec(r[4] & 0x3f);
+    ds3231_snapshot.date.month = bcdtodec(r[5] & 0x1f);
+    ds3231_snapshot.date.year = bcdtodec(r[6]);
+    ds3231_snapshot.control = r[14];
+    ds3231_snapshot.status = r[15];
+    ds3231_snapshot.aging = (int8_t)r[16];
+    ds3231_snapshot.temp = ds3231_convert_temp_q(r[17], r[18]);
+
+    if (++ds3231_snapshot_seq == 0) {
+        ds3231_snapshot_seq = 1;
+    }
+}
+
+/* Convert the two temperature registers into Q8.2 (signed quarter
+   degrees celsius). MSB is the two's complement integer part, the
+   highest two bits of the LSB are quarters. */
+int16_t ds3231_convert_temp_q(uint8_t msb, uint8_t lsb) {
     /* the LSB of temp is stored at the MSB of the word for some
        reason */
-    return((float)msb + (float)(lsb >> 6)/4.0);
+    return((int16_t)(int8_t)msb*4 + (lsb >> 6));
 }
 
-/* Retrieve temperature from DS3231 and return as a float */
-float ds3231_get_temp(void) {
-    uint8_t t_msb;
-    uint8_t t_lsb;
+/* Write a Q8.2 temperature as "[-]dd.dd" into buf (at least 8
+   bytes), returns the length */
+uint8_t ds3231_format_temp(char *buf, int16_t t) {
+    uint8_t j = 0;
 
-    while(TWI_busy) {};
-    TWI_buffer_out[0] = 0x11;
-    TWI_master_start_write_then_read(DS3231_ADDR, 1, 2);
-    while(TWI_busy) {};
+    if (t < 0) {
+        buf[j++] = '-';
+        t = -t;
+    }
+    j += sprintf(buf + j, "%i.%02i", t >> 2, (t & 0x03)*25);
+    return(j);
+}
 
-    t_msb = TWI_buffer_in[0];
-    t_lsb = TWI_buffer_in[1];
-    return(ds3231_convert_temp(t_msb, t_lsb));
+#ifdef DS3231_FLOAT_API
+/* Float wrapper, only for code that really wants degrees as a
+   float (pulls in the soft-float library) */
+float ds3231_convert_temp(uint8_t msb, uint8_t lsb) {
+    return((float)ds3231_convert_temp_q(msb, lsb)/4.0);
 }
+#endif
         
 /* blink LED on square wave stuff (for now) 
    Eventually this will be one of the 1 PPS timing interrupts */
 ISR(INT6_vect) {
-    increment_time();
-    if (led) {
-        PORTD &= ~(1 << PD6);
-        led = 0;
-    } else {
-        PORTD |= (1 << PD6);
-        led = 1;
+    uint8_t latched = 0;
+
+    ds3231_pps_stamp = timebase_ticks();
+    /* Pre-rendered second up first, the bookkeeping can wait */
+    if (rtc_drives_time) {
+        latched = spi_latch_armed();
+    }
+    ds3231_pps_seq++;
+    ds3231_snapshot_due = 1;
+    sched_wake();
+
+    if (rtc_drives_time) {
+        timebase_mark(ds3231_pps_stamp, TIMEBASE_SRC_RTC);
+        increment_time(latched);
+        if (led) {
+            PORTD &= ~(1 << PD6);
+            led = 0;
+        } else {
+            PORTD |= (1 << PD6);
+            led = 1;
+        }
     }
 }
 
@@ -16,21 +16,60 @@
 #define _ds3231_get_date ds3231_get_reg_as_int
 #define _ds3231_get_year ds3231_get_reg_as_int
 
+/* ds3231_init() waits on the bus (boot only), returns 0 or a
+   TWI_ERR_* code */
+
+/* _async call results */
+#define DS3231_ASYNC_BUSY 0
+#define DS3231_ASYNC_DONE 1
+#define DS3231_ASYNC_ERROR 2
+
+/* _async reads */
+#define DS3231_OP_NONE 0
+#define DS3231_OP_DATE 1
+#define DS3231_OP_TIME 2
+#define DS3231_OP_TEMP 3
+#define DS3231_OP_REGS 4
+
+/* Registers 0x00-0x12, read in one burst just after each 1 Hz edge
+   so it can't straddle the DS3231's own update */
+typedef struct {
+    nixie_time_t time;
+    nixie_date_t date;
+    uint8_t day;
+    uint8_t control;
+    uint8_t status;
+    int8_t aging;
+    int16_t temp; // Q8.2, quarter degrees C
+} ds3231_snapshot_t;
+
+ds3231_snapshot_t ds3231_snapshot;
+/* Bumped each time the snapshot is refreshed (0 = never read) */
+volatile uint8_t ds3231_snapshot_seq;
+
+/* timebase_ticks() of the last 1 Hz edge and a count of edges */
+volatile uint32_t ds3231_pps_stamp;
+volatile uint8_t ds3231_pps_seq;
 
 void ds3231_hw_init(void);
 uint8_t ds3231_init(void);
 void ds3231_enable_int(void);
 void ds3231_disable_int(void);
-void ds3231_set_time_gps(gps_rmc_time_t);
-void ds3231_set_time(nixie_time_t);
-void ds3231_set_date(gps_rmc_date_t);
-void ds3231_get_date(nixie_date_t *);
-uint8_t ds3231_get_registers(uint8_t *);
 uint8_t ds3231_get_reg_as_int(uint8_t);
 uint8_t ds3231_print_info(char *);
+int16_t ds3231_convert_temp_q(uint8_t, uint8_t);
+uint8_t ds3231_format_temp(char *, int16_t);
+#ifdef DS3231_FLOAT_API
 float ds3231_convert_temp(uint8_t, uint8_t);
-float ds3231_get_temp(void);
-uint8_t ds3231_get_time_digits(nixie_time_digits_t *);
+#endif
+uint8_t ds3231_get_date_async(nixie_date_t *);
+uint8_t ds3231_get_time_digits_async(nixie_time_digits_t *);
+uint8_t ds3231_get_temp_async(int16_t *);
+uint8_t ds3231_get_registers_async(uint8_t *);
+uint8_t ds3231_set_time_gps_async(gps_rmc_time_t);
+uint8_t ds3231_set_time_async(nixie_time_t);
+uint8_t ds3231_set_date_async(gps_rmc_date_t);
+void ds3231_task(void);
 
 #endif
 
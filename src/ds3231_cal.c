@@ -0,0 +1,355 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   DS3231 aging offset calibration against GPS PPS. The discipline
+   loop's DS3231 frequency estimate is averaged over an hour of
+   settled tracking, then the aging register is moved a bounded number
+   of LSBs towards zero error. The register is kept in EEPROM so it
+   survives a power cycle without GPS.
+
+   Alongside, the measured error is learned per quarter degree of
+   DS3231 temperature into an EEPROM table, which predicts how the
+   error moves with temperature during holdover.
+*/
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include <stdlib.h>
+#include "twi_master.h"
+#include "ds3231.h"
+#include "ds3231_cal.h"
+#include "discipline.h"
+
+static ds3231_cal_t EEMEM ds3231_cal_ee;
+static uint8_t EEMEM ds3231_drift_magic;
+static int16_t EEMEM ds3231_drift_ee[DS3231_DRIFT_BINS];
+
+static uint8_t cal_seq = 0;
+static int32_t cal_sum = 0;
+
+/* Aging write, then a read of control and status and a write of
+   control to set CONV, all chained from the TWI completion
+   callbacks. CONV is ignored while BSY is set, so a busy DS3231 has
+   the read retried from ds3231_cal_task() a second later. */
+static TWI_transaction_t cal_aging_xfer;
+static volatile uint8_t cal_aging_buf;
+static TWI_transaction_t cal_ctrl_xfer;
+/* control, status */
+static volatile uint8_t cal_ctrl_buf[2];
+static volatile uint8_t cal_conv_pending = 0;
+
+/* Bytes of a fresh drift table set to empty so far, one per pass so
+   the EEPROM writes never hold up the main loop. DRIFT_READY once
+   the magic is written too. */
+#define DRIFT_TABLE_BYTES sizeof(ds3231_drift_ee)
+#define DRIFT_READY (DRIFT_TABLE_BYTES + 1)
+static uint16_t drift_clear = DRIFT_READY;
+
+static uint8_t drift_count = 0;
+static uint8_t drift_holdover = 0;
+static int16_t drift_hold_temp = 0;
+static int32_t drift_hold_freq = 0;
+
+/* EEPROM table index for a temperature, or DS3231_DRIFT_BINS if it
+   is out of range */
+static uint8_t ds3231_drift_bin(int16_t temp) {
+    if ((temp < DS3231_DRIFT_TEMP_MIN) ||
+        (temp >= DS3231_DRIFT_TEMP_MIN + DS3231_DRIFT_BINS)) {
+        return(DS3231_DRIFT_BINS);
+    }
+    return((uint8_t)(temp - DS3231_DRIFT_TEMP_MIN));
+}
+
+/* Stored error for a temperature, DS3231_DRIFT_EMPTY if not learned */
+int16_t ds3231_drift_get(int16_t temp) {
+    uint8_t bin = ds3231_drift_bin(temp);
+
+    if ((bin == DS3231_DRIFT_BINS) || (drift_clear != DRIFT_READY)) {
+        return(DS3231_DRIFT_EMPTY);
+    }
+    return((int16_t)eeprom_read_word((const uint16_t *)&ds3231_drift_ee[bin]));
+}
+
+/* Fold a settled measurement into its bin */
+static void ds3231_drift_learn(int16_t temp, int32_t ppb) {
+    uint8_t bin = ds3231_drift_bin(temp);
+    int16_t old = 0;
+    int32_t est = 0;
+
+    if ((bin == DS3231_DRIFT_BINS) || (drift_clear != DRIFT_READY)) {
+        return;
+    }
+
+    /* Normalize to aging 0 so calibration steps don't invalidate the
+       table */
+    ppb -= (int32_t)ds3231_cal_aging*DS3231_CAL_LSB_PPB;
+    if (ppb > INT16_MAX) {
+        ppb = INT16_MAX;
+    } else if (ppb <= DS3231_DRIFT_EMPTY) {
+        ppb = DS3231_DRIFT_EMPTY + 1;
+    }
+
+    old = ds3231_drift_get(temp);
+    if (old == DS3231_DRIFT_EMPTY) {
+        est = ppb;
+    } else {
+        est = old + ((ppb - old) >> 2);
+        if (labs(est - old) < DS3231_DRIFT_WRITE_PPB) {
+            return;
+        }
+    }
+    eeprom_update_word((uint16_t *)&ds3231_drift_ee[bin], (uint16_t)est);
+}
+
+/* Every conversion: learn while settled on GPS, and while in holdover
+   move the frequency estimate by the table difference between the
+   temperature now and at the start of holdover */
+static void ds3231_drift_task(void) {
+    int16_t now = 0;
+    int16_t then = 0;
+
+    if (++drift_count < DS3231_DRIFT_PERIOD_S) {
+        return;
+    }
+    drift_count = 0;
+
+    if (!ds3231_snapshot_seq) {
+        return;
+    }
+    ds3231_drift_temp = ds3231_snapshot.temp;
+    ds3231_drift_ppb = ds3231_drift_get(ds3231_drift_temp);
+
+    if ((discipline_state == DISCIPLINE_TRACK) &&
+        (discipline_tau == DISCIPLINE_TAU_MAX)) {
+        ds3231_drift_learn(ds3231_drift_temp, discipline_ppb(discipline_rtc_freq));
+    }
+
+    if (discipline_state != DISCIPLINE_HOLDOVER) {
+        drift_holdover = 0;
+        return;
+    }
+
+    if (!drift_holdover) {
+        drift_holdover = 1;
+        drift_hold_temp = ds3231_drift_temp;
+        drift_hold_freq = discipline_rtc_freq;
+        return;
+    }
+
+    now = ds3231_drift_ppb;
+    then = ds3231_drift_get(drift_hold_temp);
+    if ((now != DS3231_DRIFT_EMPTY) && (then != DS3231_DRIFT_EMPTY)) {
+        discipline_rtc_freq = drift_hold_freq + discipline_q8((int32_t)now - then);
+    }
+}
+
+/* Save state in EEPROM (only changed bytes are written) */
+static void ds3231_cal_save(void) {
+    ds3231_cal_t cal;
+
+    cal.magic = DS3231_CAL_MAGIC;
+    cal.aging = ds3231_cal_aging;
+    cal.steps = ds3231_cal_steps;
+    eeprom_update_block(&cal, &ds3231_cal_ee, sizeof(cal));
+}
+
+/* Empty one more byte of a fresh drift table if the EEPROM is free */
+static void ds3231_drift_clear_step(void) {
+    if ((drift_clear == DRIFT_READY) || !eeprom_is_ready()) {
+        return;
+    }
+
+    if (drift_clear < DRIFT_TABLE_BYTES) {
+        /* DS3231_DRIFT_EMPTY, little endian */
+        eeprom_update_byte((uint8_t *)ds3231_drift_ee + drift_clear,
+                           (drift_clear & 1) ? 0x80 : 0x00);
+    } else {
+        eeprom_update_byte(&ds3231_drift_magic, DS3231_DRIFT_MAGIC);
+    }
+    drift_clear++;
+}
+
+/* TWI ISR: control and status read, set CONV and write control back
+   unless a conversion is already running */
+static void ds3231_cal_ctrl_done(TWI_transaction_t *t) {
+    if ((t->status != TWI_TRANS_DONE) || t->write_bytes) {
+        return;
+    }
+
+    if (cal_ctrl_buf[1] & (1 << DS3231_BSY)) {
+        cal_conv_pending = 1;
+        return;
+    }
+
+    cal_ctrl_buf[0] |= (1 << DS3231_CONV);
+    t->write_bytes = 1;
+    t->read_bytes = 0;
+    t->write_buf = &cal_ctrl_buf[0];
+    t->read_buf = NULL;
+    /* Queue full: the new aging applies at the next 64 s conversion
+       instead */
+    TWI_queue(t);
+}
+
+/* Queue the control and status read that starts a forced
+   conversion */
+static void ds3231_cal_ctrl_read(void) {
+    cal_ctrl_xfer.addr = DS3231_ADDR;
+    cal_ctrl_xfer.flags = TWI_FLAG_REG;
+    cal_ctrl_xfer.reg = DS3231_CONTROL_REG;
+    cal_ctrl_xfer.write_bytes = 0;
+    cal_ctrl_xfer.read_bytes = sizeof(cal_ctrl_buf);
+    cal_ctrl_xfer.write_buf = NULL;
+    cal_ctrl_xfer.read_buf = cal_ctrl_buf;
+    cal_ctrl_xfer.done = ds3231_cal_ctrl_done;
+    TWI_queue(&cal_ctrl_xfer);
+}
+
+/* TWI ISR: aging written, go and force a conversion */
+static void ds3231_cal_aging_done(TWI_transaction_t *t) {
+    if (t->status != TWI_TRANS_DONE) {
+        return;
+    }
+
+    ds3231_cal_ctrl_read();
+}
+
+/* Queue the aging register write, a conversion is forced once it is
+   done so it takes effect now instead of at the next 64 s temperature
+   conversion. Returns 1 if the last write is still going or the bus
+   queue is full. */
+static uint8_t ds3231_cal_write(int8_t aging) {
+    if ((cal_aging_xfer.status == TWI_TRANS_QUEUED) ||
+        (cal_aging_xfer.status == TWI_TRANS_ACTIVE) ||
+        (cal_ctrl_xfer.status == TWI_TRANS_QUEUED) ||
+        (cal_ctrl_xfer.status == TWI_TRANS_ACTIVE)) {
+        return 1;
+    }
+    /* This write starts its own conversion */
+    cal_conv_pending = 0;
+
+    cal_aging_buf = (uint8_t)aging;
+    cal_aging_xfer.addr = DS3231_ADDR;
+    cal_aging_xfer.flags = TWI_FLAG_REG;
+    cal_aging_xfer.reg = DS3231_AGING_REG;
+    cal_aging_xfer.write_bytes = 1;
+    cal_aging_xfer.read_bytes = 0;
+    cal_aging_xfer.write_buf = &cal_aging_buf;
+    cal_aging_xfer.read_buf = NULL;
+    cal_aging_xfer.done = ds3231_cal_aging_done;
+    return(TWI_queue(&cal_aging_xfer));
+}
+
+/* Load the stored aging offset, called by ds3231_init() */
+int8_t ds3231_cal_init(void) {
+    ds3231_cal_t cal;
+
+    eeprom_read_block(&cal, &ds3231_cal_ee, sizeof(cal));
+    if (cal.magic == DS3231_CAL_MAGIC) {
+        ds3231_cal_aging = cal.aging;
+        ds3231_cal_steps = cal.steps;
+    } else {
+        ds3231_cal_aging = 0;
+        ds3231_cal_steps = 0;
+    }
+
+    ds3231_cal_count = 0;
+    ds3231_cal_ppb = 0;
+    cal_sum = 0;
+    cal_seq = ds3231_pps_seq;
+
+    /* Start a fresh drift table, ds3231_cal_task() fills it in */
+    if (eeprom_read_byte(&ds3231_drift_magic) != DS3231_DRIFT_MAGIC) {
+        drift_clear = 0;
+    } else {
+        drift_clear = DRIFT_READY;
+    }
+    ds3231_drift_temp = 0;
+    ds3231_drift_ppb = DS3231_DRIFT_EMPTY;
+
+    return(ds3231_cal_aging);
+}
+
+/* Run from the main loop, works once per DS3231 second */
+void ds3231_cal_task(void) {
+    int32_t mean = 0;
+    int16_t step = 0;
+    int16_t aging = 0;
+    uint8_t seq = 0;
+
+    ds3231_drift_clear_step();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        seq = ds3231_pps_seq;
+    }
+    if (seq == cal_seq) {
+        return;
+    }
+    cal_seq = seq;
+
+    /* Forced conversion found the DS3231 busy, try again */
+    if (cal_conv_pending && (cal_ctrl_xfer.status != TWI_TRANS_QUEUED) &&
+        (cal_ctrl_xfer.status != TWI_TRANS_ACTIVE)) {
+        cal_conv_pending = 0;
+        ds3231_cal_ctrl_read();
+    }
+
+    ds3231_drift_task();
+
+    /* Only average once the loop has settled on GPS */
+    if ((discipline_state != DISCIPLINE_TRACK) ||
+        (discipline_tau < DISCIPLINE_TAU_MAX)) {
+        ds3231_cal_count = 0;
+        cal_sum = 0;
+        return;
+    }
+
+    cal_sum += discipline_rtc_freq;
+    ds3231_cal_count++;
+    if (ds3231_cal_count < DS3231_CAL_WINDOW_S) {
+        return;
+    }
+
+    mean = cal_sum/DS3231_CAL_WINDOW_S;
+    ds3231_cal_ppb = discipline_ppb(mean);
+    ds3231_cal_count = 0;
+    cal_sum = 0;
+
+    if (labs(ds3231_cal_ppb) < DS3231_CAL_DEADBAND_PPB) {
+        return;
+    }
+
+    /* A slow DS3231 (positive error) needs less aging capacitance */
+    step = -(ds3231_cal_ppb + ((ds3231_cal_ppb > 0) ? DS3231_CAL_LSB_PPB/2 :
+                               -DS3231_CAL_LSB_PPB/2))/DS3231_CAL_LSB_PPB;
+    if (step > DS3231_CAL_STEP_MAX) {
+        step = DS3231_CAL_STEP_MAX;
+    } else if (step < -DS3231_CAL_STEP_MAX) {
+        step = -DS3231_CAL_STEP_MAX;
+    }
+
+    aging = ds3231_cal_aging + step;
+    if (aging > 127) {
+        aging = 127;
+    } else if (aging < -128) {
+        aging = -128;
+    }
+    step = aging - ds3231_cal_aging;
+    if (step == 0) {
+        return;
+    }
+
+    if (ds3231_cal_write((int8_t)aging)) {
+        /* Try again after the next window */
+        return;
+    }
+    ds3231_cal_aging = (int8_t)aging;
+    ds3231_cal_steps++;
+    ds3231_cal_save();
+
+    /* Move the loop's estimate by the expected change rather than
+       waiting for it to relearn (LSB_PPB in Q8 CPU ticks per second) */
+    discipline_rtc_freq += (int32_t)step*
+        (int32_t)((F_CPU/1000000UL)*DS3231_CAL_LSB_PPB*256UL/1000UL);
+}
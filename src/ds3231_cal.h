@@ -0,0 +1,60 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   DS3231 aging offset calibration against GPS PPS
+*/
+
+#ifndef _DS3231_CAL_H_
+#define _DS3231_CAL_H_
+
+#include <stdint.h>
+
+#define DS3231_AGING_REG 0x10
+#define DS3231_CONTROL_REG 0x0e
+#define DS3231_CONV 5
+#define DS3231_STATUS_REG 0x0f
+#define DS3231_BSY 2
+
+/* Marks a programmed calibration block in EEPROM */
+#define DS3231_CAL_MAGIC 0xa5
+
+/* Seconds of settled tracking averaged per calibration step */
+#define DS3231_CAL_WINDOW_S 3600
+/* Aging LSB is ~0.1 ppm at 25C, positive values slow the clock */
+#define DS3231_CAL_LSB_PPB 100
+/* Largest change per window, and no change inside the deadband */
+#define DS3231_CAL_STEP_MAX 4
+#define DS3231_CAL_DEADBAND_PPB 50
+
+/* Drift table, DS3231 error (ppb at aging 0) per quarter degree from
+   10 to 50 C */
+#define DS3231_DRIFT_MAGIC 0x5a
+#define DS3231_DRIFT_TEMP_MIN (10*4)
+#define DS3231_DRIFT_BINS (40*4)
+#define DS3231_DRIFT_EMPTY ((int16_t)0x8000)
+/* The DS3231 converts every 64 s, no point reading faster */
+#define DS3231_DRIFT_PERIOD_S 64
+/* Only rewrite a bin when it moves this much (EEPROM wear) */
+#define DS3231_DRIFT_WRITE_PPB 10
+
+typedef struct {
+    uint8_t magic;
+    int8_t aging;
+    uint16_t steps;
+} ds3231_cal_t;
+
+/* Current aging offset, calibration steps taken, seconds in the
+   running window and the last window's mean error */
+int8_t ds3231_cal_aging;
+uint16_t ds3231_cal_steps;
+uint16_t ds3231_cal_count;
+int32_t ds3231_cal_ppb;
+/* Last temperature read (Q8.2) and its bin value */
+int16_t ds3231_drift_temp;
+int16_t ds3231_drift_ppb;
+
+int8_t ds3231_cal_init(void);
+void ds3231_cal_task(void);
+int16_t ds3231_drift_get(int16_t temp);
+
+#endif
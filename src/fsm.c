@@ -0,0 +1,109 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Table driven hierarchical state machines. Each state is a PROGMEM
+   row of handlers and a parent, states without a handler of their own
+   use their parent's.
+*/
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "fsm.h"
+
+static inline uint8_t fsm_parent(const fsm_state_t *t, uint8_t s) {
+    return(pgm_read_byte(&t[s].parent));
+}
+
+static inline void fsm_call(void (*fn)(void)) {
+    if (fn) {
+        fn();
+    }
+}
+
+/* Start in state, entering it and its parents outermost first */
+void fsm_init(fsm_t *f, const fsm_state_t *table, uint8_t state) {
+    f->table = table;
+    f->state = FSM_NONE;
+    f->next = state;
+    fsm_transition(f);
+}
+
+/* Take a pending transition: exit up to the common parent, then enter
+   down to the new state. The exits, the state change and the entries
+   run with interrupts off, so an event from an ISR (the PPS second)
+   never lands in a half left or half entered state. */
+void fsm_transition(fsm_t *f) {
+    const fsm_state_t *t = f->table;
+    uint8_t path[FSM_DEPTH];
+    uint8_t to = f->next;
+    uint8_t s = 0;
+    uint8_t n = 0;
+    uint8_t i = 0;
+
+    if (to == f->state) {
+        return;
+    }
+
+    /* The new state and its parents */
+    for (s = to; (s != FSM_NONE) && (n < FSM_DEPTH); s = fsm_parent(t, s)) {
+        path[n++] = s;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        /* Leave everything not shared with the new state */
+        s = f->state;
+        while (s != FSM_NONE) {
+            for (i = 0; i < n; i++) {
+                if (path[i] == s) {
+                    break;
+                }
+            }
+            if (i < n) {
+                break;
+            }
+            fsm_call((void (*)(void))pgm_read_word(&t[s].exit));
+            s = fsm_parent(t, s);
+        }
+        if (s == FSM_NONE) {
+            i = n;
+        }
+
+        f->state = to;
+        while (i-- > 0) {
+            fsm_call((void (*)(void))pgm_read_word(&t[path[i]].entry));
+        }
+    }
+}
+
+/* Take any pending transition and run the state's tick handler */
+void fsm_tick(fsm_t *f) {
+    void (*fn)(void) = 0;
+    uint8_t s = 0;
+
+    fsm_transition(f);
+
+    for (s = f->state; s != FSM_NONE; s = fsm_parent(f->table, s)) {
+        fn = (void (*)(void))pgm_read_word(&f->table[s].tick);
+        if (fn) {
+            fn();
+            break;
+        }
+    }
+}
+
+/* Hand an event to the current state, then up its parents until one
+   handles it */
+uint8_t fsm_event(fsm_t *f, uint8_t ev, const void *arg) {
+    uint8_t (*fn)(uint8_t, const void *) = 0;
+    uint8_t s = 0;
+
+    for (s = f->state; s != FSM_NONE; s = fsm_parent(f->table, s)) {
+        fn = (uint8_t (*)(uint8_t, const void *))pgm_read_word(&f->table[s].event);
+        if (fn && fn(ev, arg)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Table driven hierarchical state machines. Each state is a PROGMEM
+   row of handlers and a parent, states without a handler of their own
+   use their parent's.
+*/
+
+#ifndef _FSM_H_
+#define _FSM_H_
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/* No parent */
+#define FSM_NONE 0xff
+
+/* Deepest nesting of states */
+#define FSM_DEPTH 4
+
+/* State table row (PROGMEM), any handler may be 0. entry and exit
+   run with interrupts off, keep them short. */
+typedef struct {
+    uint8_t parent;
+    void (*entry)(void);
+    void (*exit)(void);
+    /* Called from fsm_tick() */
+    void (*tick)(void);
+    /* Returns 1 if the event was handled, otherwise it goes to the
+       parent */
+    uint8_t (*event)(uint8_t ev, const void *arg);
+} fsm_state_t;
+
+typedef struct {
+    const fsm_state_t *table;
+    volatile uint8_t state;
+    volatile uint8_t next;
+} fsm_t;
+
+void fsm_init(fsm_t *f, const fsm_state_t *table, uint8_t state);
+void fsm_transition(fsm_t *f);
+void fsm_tick(fsm_t *f);
+uint8_t fsm_event(fsm_t *f, uint8_t ev, const void *arg);
+
+/* Ask for a transition, taken on the next fsm_transition() or
+   fsm_tick(). Safe from ISRs, the last request wins. */
+static inline void fsm_post(fsm_t *f, uint8_t state) {
+    f->next = state;
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <avr/wdt.h>
 #include <avr/power.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,13 +17,23 @@
 #include "mtk3339.h"
 #include "nmea.h"
 #include "spi.h"
-
-/* Clock operation modes */
-#define GPS_FIX_NEW 1
-#define GPS_FIX_STABLE 2
-#define GPS_FIX_NONE 3
-#define GPS_FIX_CHECK_TIME 4
-#define MAN_SET_TIME 5
+#include "tick.h"
+#include "timebase.h"
+#include "discipline.h"
+#include "ds3231_cal.h"
+#include "nixie.h"
+#include "sched.h"
+#include "sw.h"
+#include "fsm.h"
+
+/* Clock operation modes (clock_fsm states) */
+#define GPS_FIX_NEW 0
+#define GPS_FIX_STABLE 1
+#define GPS_FIX_NONE 2
+#define GPS_FIX_CHECK_TIME 3
+#define MAN_SET_TIME 4
+/* Parent of the modes following the GPS PPS */
+#define GPS_FIX_LOCKED 5
 
 /* Tube display modes */
 #define NIXIE_TIME_MODE 0
@@ -33,43 +44,121 @@
 #define NIXIE_TEMP_MODE 5
 #define NIXIE_COUNT_MODE 6
 #define NIXIE_BOUNCE_MODE 7
+/* Parents, everything but the set modes and the set modes */
+#define NIXIE_RUN 8
+#define NIXIE_SETTING 9
 
-#define SEC_OS 0
-#define TENS_SEC_OS 10
-#define MIN_OS 20
-#define TENS_MIN_OS 32
-#define HR_OS 42
-#define TENS_HR_OS 52
+/* Display events */
+#define NIXIE_EV_SECOND 0
+#define NIXIE_EV_SWITCH 1
 
-/* Switch positions */
-#define SW_TSET 0x01
-#define SW_NEXT 0x02
-#define SW_TUP 0x04
-#define SW_TDOWN 0x08
-#define SW_SHDN 0x10
+/* Holding up/down while setting repeats after the delay, then at
+   the rate */
+#define UI_REPEAT_DELAY_MS 500
+#define UI_REPEAT_MS 150
 
 static inline uint8_t tmod(uint8_t);
 static inline uint8_t dectobcd(uint8_t);
 static inline void time_to_nix_digits(nixie_time_t, nixie_time_digits_t *);
+static inline uint8_t bcd_inc(volatile uint8_t *, uint8_t);
+static inline uint8_t bcd_dec(volatile uint8_t *, uint8_t);
+static void gps_to_local_time(gps_rmc_time_t, nixie_time_t *);
 static void date_to_nixie_digits(nixie_date_t, volatile uint8_t *);
-static void temp_to_nixie_digits(float, volatile uint8_t *);
+static void temp_to_nixie_digits(int16_t, volatile uint8_t *);
 static inline void nixie_time_to_nixie_digits(nixie_time_digits_t, volatile uint8_t *);
-static inline void blank_digit(uint8_t, volatile uint8_t *);
 static void set_system_time(nixie_time_digits_t);
+static inline uint8_t time_equal(nixie_time_t *, volatile nixie_time_t *);
+static void frame_prerender(void);
+static void frame_disarm(void);
+static void gps_mode_task(void);
+static void rtc_task(void);
+static void clock_task(void);
+static void display_task(void);
+static void usb_cmd_task(void);
+static void nmea_task(void);
+static void usb_task(void);
+static void ui_task(void);
+static void ui_event(sw_event_t *);
+static void set_digit_up(void);
+static void set_digit_down(void);
+static uint8_t time_event(uint8_t, const void *);
+static uint8_t count_event(uint8_t, const void *);
+static void wave_entry(void);
+static void wave_tick(void);
+static void date_entry(void);
+static void date_tick(void);
+static void temp_tick(void);
+static void bounce_entry(void);
+static void bounce_tick(void);
+static uint8_t run_event(uint8_t, const void *);
+static void setting_entry(void);
+static void setting_exit(void);
+static void setting_tick(void);
+static uint8_t setting_event(uint8_t, const void *);
+static void set_entry(void);
+static uint8_t set_event(uint8_t, const void *);
+static void set_count_entry(void);
+static void set_count_exit(void);
+static uint8_t set_count_event(uint8_t, const void *);
+static void fix_new_entry(void);
+static void fix_new_tick(void);
+static void fix_locked_entry(void);
+static void fix_locked_exit(void);
+static void fix_stable_tick(void);
+static void fix_check_tick(void);
+static void fix_none_entry(void);
+static void man_set_tick(void);
 
 /* usb data transmit ready status */
 volatile bool dtr_status;
 volatile uint8_t seconds_cnt = 0;
 /* seconds -> hours from indices 0->8 */
 volatile uint8_t nixie_digits[8];
-volatile uint8_t nixie_mode = 0;
-volatile uint8_t mode = 0;
 /* switch time set items */
-volatile uint8_t pa = 0x1f;
 volatile uint8_t test = 0x00;
-volatile uint8_t pa_store = 0x1f;
 volatile uint8_t hv = 0x00;
 volatile uint8_t set_digit = 5;
+/* Switch being auto-repeated and when it next fires */
+static uint8_t ui_repeat = 0;
+static uint16_t ui_repeat_tick = 0;
+
+/* Display mode animation */
+static uint16_t k = 0;
+static uint8_t wave_cnt = 0;
+static uint8_t sw_cnt = 0;
+static uint8_t blink_sw = 0;
+static uint8_t date_cnt = 0;
+/* bounce mode stuff */
+static uint8_t bnc_cnt = 0;
+static uint8_t bnc_dig = 5;
+static uint8_t bnc_sw = 0;
+
+/* Display modes: parent, entry, exit, tick (every 10 ms), event */
+static const fsm_state_t nixie_states[] PROGMEM = {
+    [NIXIE_TIME_MODE] = {NIXIE_RUN, 0, frame_disarm, 0, time_event},
+    [NIXIE_WAVE_MODE] = {NIXIE_RUN, wave_entry, 0, wave_tick, 0},
+    [NIXIE_SET_MODE] = {NIXIE_SETTING, set_entry, 0, 0, set_event},
+    [NIXIE_SET_COUNT_MODE] = {NIXIE_SETTING, set_count_entry, set_count_exit, 0, set_count_event},
+    [NIXIE_DATE_MODE] = {NIXIE_RUN, date_entry, 0, date_tick, 0},
+    [NIXIE_TEMP_MODE] = {NIXIE_RUN, date_entry, 0, temp_tick, 0},
+    [NIXIE_COUNT_MODE] = {NIXIE_RUN, 0, frame_disarm, 0, count_event},
+    [NIXIE_BOUNCE_MODE] = {NIXIE_RUN, bounce_entry, 0, bounce_tick, 0},
+    [NIXIE_RUN] = {FSM_NONE, 0, 0, 0, run_event},
+    [NIXIE_SETTING] = {FSM_NONE, setting_entry, setting_exit, setting_tick, setting_event}
+};
+
+/* Clock modes: parent, entry, exit, tick (every 10 ms), event */
+static const fsm_state_t clock_states[] PROGMEM = {
+    [GPS_FIX_NEW] = {FSM_NONE, fix_new_entry, 0, fix_new_tick, 0},
+    [GPS_FIX_STABLE] = {GPS_FIX_LOCKED, 0, 0, fix_stable_tick, 0},
+    [GPS_FIX_NONE] = {FSM_NONE, fix_none_entry, 0, 0, 0},
+    [GPS_FIX_CHECK_TIME] = {GPS_FIX_LOCKED, 0, 0, fix_check_tick, 0},
+    [MAN_SET_TIME] = {FSM_NONE, 0, 0, man_set_tick, 0},
+    [GPS_FIX_LOCKED] = {FSM_NONE, fix_locked_entry, fix_locked_exit, 0, 0}
+};
+
+fsm_t display_fsm;
+fsm_t clock_fsm;
 
 nixie_time_t the_time = {.seconds = 0, 
                          .minutes = 0, 
@@ -94,6 +183,13 @@ nixie_time_digits_t time_setting = {.seconds = 0,
                                     .hours = 0, 
                                     .tens_hours = 0}; 
 
+/* Next second's frame, shifted into the HV5522s ahead of the edge
+   so the PPS ISR only has to latch it (spi_frame_armed), and the
+   time, mode and hold state it was built from */
+static nixie_time_t frame_base;
+static uint8_t frame_mode = 0;
+static uint8_t frame_hold = 0;
+
 /* Sequence of digits that loop through every digit in the tube in
    height order and back */
 volatile const uint8_t dig_loop[18] = {1, 0, 2, 6, 9, 5, 7, 8, 4, 3, 4, 8, 7, 5, 9, 6, 2, 0};
@@ -149,44 +245,32 @@ USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface = {
 //static FILE USBSerialStream;
 
 
+/* Main loop tasks: function, period (ms, 0 every pass), deadline
+   (ms) */
+static const sched_task_t sched_tasks[] PROGMEM = {
+    {nmea_task, 0, 0},
+    {rtc_task, 0, 0},
+    {clock_task, 0, 0},
+    {gps_mode_task, 10, 10},
+    {ui_task, 10, 10},
+    {display_task, 10, 5},
+    {usb_cmd_task, 10, 20},
+    {usb_task, 0, 0}
+};
+#define SCHED_TASKS (sizeof(sched_tasks)/sizeof(sched_tasks[0]))
+
+static sched_stat_t sched_stats[SCHED_TASKS];
+
 /* Main program entry point. This routine contains the overall program
  * flow, including initial setup of all components and the main
  * program loop.
  */
 int main(void) {
-    uint8_t my_byte = 0;
-    uint16_t rx_num_bytes = 0;
-    uint16_t i = 0;
-    uint16_t j = 0;
-    uint8_t sw = 0;
-    uint8_t cdc_dev_status = 0;
-    char sbuf[255];
-    //float t = 0.0;
-    //uint8_t memwad[19];
-    uint8_t e_stat = 0;
-    uint8_t gps_fix_state = 0;
-
-    uint16_t k = 0;
-    uint8_t p = 0;
-
-    uint8_t wave_cnt = 0;
-
-    uint8_t sw_cnt = 0;
-    uint8_t blink_sw = 0;
-
-    uint8_t date_cnt = 0;
-    float temp = 0;
-    uint8_t nixie_mode_last = 0;
-    /* bounce mode stuff */
-    uint8_t bnc_cnt = 0;
-    uint8_t bnc_dig = 5;
-    uint8_t bnc_sw = 0;
-
     /* Let ISP verification work? */
     //_delay_ms(5);
 
-    nixie_mode = NIXIE_TIME_MODE;
-    nixie_mode_last = NIXIE_TIME_MODE;
+    /* Before any PPS edge can dispatch through it */
+    fsm_init(&display_fsm, nixie_states, NIXIE_TIME_MODE);
 
     /* Initialize at90usb1287 peripherals */
     setup_hardware();
@@ -207,381 +291,695 @@ int main(void) {
     //pgtop = 0;
     //gprmc = 0;
 
-    /* Wait for a valid GPS packet before initializing it (boot
-       time) */
-    while(pgtop < 1) {
-        uart_task();
-        CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
-        USB_USBTask();
-    }
-
     /* Initialize the DS3231 RTC */
     ds3231_init();
 
-    /* Initialize MTK3339 GPS unit */
+    /* Start MTK3339 GPS unit autobaud and configuration (runs from
+       the main loop) */
     mtk3339_init();
 
-    /* Start by assuming no GPS fix */
-    mode = GPS_FIX_NONE;
-    gps_fix_state = 0;
-    /* default mode ds3231 */
-    PORTC |= (1 << PC6);
+    /* Start by assuming no GPS fix, default mode ds3231 */
+    fsm_init(&clock_fsm, clock_states, GPS_FIX_NONE);
+
+    sched_init(sched_stats, SCHED_TASKS);
 
     /* make the magic happen */
     for (;;) {
-        /* Check GPS fix status and switch modes if needed */
-        if (gps_fix != gps_fix_state) {
-            gps_fix_state = gps_fix;
-            if (gps_fix) {
-                mode = GPS_FIX_NEW;
-                seconds_cnt = 0;
-                /* 3D Fix on */
-                PORTC |= (1 << PC4);
-            } else {
-                /* Enable ds3231 pps line */
-                mode = GPS_FIX_NONE;
-                mtk3339_disable_int();
-                ds3231_enable_int();
-                /* 3D Fix off */
-                PORTC &= ~(1 << PC4);
-                /* GPS mode off/ ds3231 mode on */
-                PORTC &= ~(1 << PC5);
-                PORTC |= (1 << PC6);
-            }
+        sched_run(sched_tasks, sched_stats, SCHED_TASKS);
+        /* Nothing left to do until the next interrupt */
+        sched_sleep();
+    }
+}
+
+
+/* GPS fix tracking and the clock mode state machine */
+static void gps_mode_task(void) {
+    static uint8_t gps_fix_state = 0;
+
+    /* Check GPS fix status and switch modes if needed */
+    if (gps_fix != gps_fix_state) {
+        gps_fix_state = gps_fix;
+        if (gps_fix) {
+            fsm_post(&clock_fsm, GPS_FIX_NEW);
+        } else {
+            fsm_post(&clock_fsm, GPS_FIX_NONE);
         }
+    }
+
+    fsm_tick(&clock_fsm);
+}
+
+/* Clock mode handlers */
 
-        /* Handle mode tasks */
-        switch(mode) {
-        case GPS_FIX_NEW:
-            if (seconds_cnt > 9) {
-                mode = GPS_FIX_STABLE;
+static void fix_new_entry(void) {
+    seconds_cnt = 0;
+    /* 3D Fix on */
+    PORTC |= (1 << PC4);
+}
+
+static void fix_new_tick(void) {
+    uint8_t pps_ok = 0;
+    gps_rmc_time_t pps_time;
+
+    if (seconds_cnt > 9) {
+        /* Hand over to the PPS line only once an RMC has been tied to
+           the last edge, so the next edge is unambiguously label + 1 */
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            pps_ok = mtk3339_pps_time(&pps_time);
+            if (pps_ok) {
                 ds3231_disable_int();
-                the_time.hours = tmod(gps_time.hours - 7);
-                the_time.minutes = gps_time.minutes;
-                the_time.seconds = gps_time.seconds;
-                /* Set ds3231 date/time */
-                ds3231_set_time_gps(gps_time);
-                ds3231_set_date(gps_date);
+                gps_to_local_time(pps_time, &the_time);
                 mtk3339_enable_int();
-                PORTC &= ~(1 << PC6);
-                PORTC |= (1 << PC5);
             }
-            break;
-        case GPS_FIX_STABLE:
-            if (seconds_cnt > 254) {
-                mode = GPS_FIX_CHECK_TIME;
-            }
-            break;
-        case GPS_FIX_NONE:
-            break;
-        case GPS_FIX_CHECK_TIME:
-            if ((the_time.seconds != gps_time.seconds) |
-                (the_time.minutes != gps_time.minutes) |
-                (the_time.hours != tmod(gps_time.hours - 7))) {
+        }
+        if (pps_ok) {
+            fsm_post(&clock_fsm, GPS_FIX_STABLE);
+            /* Set ds3231 date/time (queued, the bus finishes them in
+               the background) */
+            ds3231_set_time_gps_async(pps_time);
+            ds3231_set_date_async(gps_date);
+            PORTC &= ~(1 << PC6);
+            PORTC |= (1 << PC5);
+        }
+    }
+}
+
+/* Only the acquisition phases need fast GPS output */
+static void fix_locked_entry(void) {
+    mtk3339_set_profile(MTK3339_PROFILE_STEADY);
+}
+
+static void fix_locked_exit(void) {
+    mtk3339_set_profile(MTK3339_PROFILE_ACQUIRE);
+}
+
+static void fix_stable_tick(void) {
+    if (seconds_cnt > 254) {
+        fsm_post(&clock_fsm, GPS_FIX_CHECK_TIME);
+    }
+}
+
+static void fix_check_tick(void) {
+    uint8_t pps_ok = 0;
+    gps_rmc_time_t pps_time;
+    nixie_time_t check_time;
+
+    /* Compare against the label of the edge that produced the_time,
+       wait here until there is one */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pps_ok = mtk3339_pps_time(&pps_time);
+        if (pps_ok) {
+            gps_to_local_time(pps_time, &check_time);
+            if ((the_time.seconds != check_time.seconds) |
+                (the_time.minutes != check_time.minutes) |
+                (the_time.hours != check_time.hours)) {
                 /* Set time */
-                the_time.hours = tmod(gps_time.hours - 7);
-                the_time.minutes = gps_time.minutes;
-                the_time.seconds = gps_time.seconds;
+                the_time.hours = check_time.hours;
+                the_time.minutes = check_time.minutes;
+                the_time.seconds = check_time.seconds;
             }
-            mode = GPS_FIX_STABLE;
-            break;
-        case MAN_SET_TIME:
-            ds3231_disable_int();
-            set_system_time(time_setting);
-            ds3231_enable_int();
-            mode = GPS_FIX_NONE;
         }
-        
+    }
+    if (pps_ok) {
+        fsm_post(&clock_fsm, GPS_FIX_STABLE);
+    }
+}
+
+/* The DS3231 drives the clock */
+static void fix_none_entry(void) {
+    /* Enable ds3231 pps line */
+    mtk3339_disable_int();
+    ds3231_enable_int();
+    /* 3D Fix off */
+    PORTC &= ~(1 << PC4);
+    /* GPS mode off/ ds3231 mode on */
+    PORTC &= ~(1 << PC5);
+    PORTC |= (1 << PC6);
+}
 
-        if (nixie_mode != nixie_mode_last) {
-            nixie_mode_last = nixie_mode;
-            /* Reset all mode-specific vars */
-            k = 0;
-            wave_cnt = 0;
-            date_cnt = 0;
-            sw_cnt = 0;
-
-            bnc_sw = 0;
-            bnc_dig = 5;
-            bnc_cnt = 0;
+static void man_set_tick(void) {
+    ds3231_disable_int();
+    set_system_time(time_setting);
+    ds3231_enable_int();
+    fsm_post(&clock_fsm, GPS_FIX_NONE);
+}
+
+/* DS3231 bus service and register snapshot */
+static void rtc_task(void) {
+    /* Time out stuck TWI transfers */
+    TWI_task();
+
+    /* Refresh the ds3231 snapshot after its 1 Hz edge */
+    ds3231_task();
+
+    /* Aging and temperature drift calibration */
+    ds3231_cal_task();
+}
+
+/* Clock discipline, slips and the next second's frame */
+static void clock_task(void) {
+    /* Track the GPS/DS3231 frequency errors and the holdover time
+       error */
+    discipline_task();
+    if (discipline_slip > 0) {
+        /* Holdover running behind by a second */
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            discipline_slip--;
+            increment_time(0);
         }
+    }
 
-        //while(1) {
-        if (nixie_mode == NIXIE_WAVE_MODE) {
-            memset((void *)nixie_digits, 0x00, 8);
-            p = SEC_OS + dig_loop[k%18];
-            nixie_digits[p/8] = (1 << p%8);
-            p = TENS_SEC_OS + dig_loop[(k + 1)%18];
-            nixie_digits[p/8] |= (1 << p%8);
-            p = MIN_OS + dig_loop[(k + 2)%18];
-            nixie_digits[p/8] |= (1 << p%8);
-            p = TENS_MIN_OS + dig_loop[(k + 3)%18];
-            nixie_digits[p/8] |= (1 << p%8);
-            p = HR_OS + dig_loop[(k + 4)%18];
-            nixie_digits[p/8] |= (1 << p%8);
-            p = TENS_HR_OS + dig_loop[(k + 5)%18];
-            nixie_digits[p/8] |= (1 << p%8);
-            
-            if (wave_cnt > 4) {
-                k++;
-                wave_cnt = 0;
-            }
+    /* Get the next second onto the tubes' shift registers */
+    frame_prerender();
+}
 
-            for (j = sizeof(nixie_digits); j-- > 0; ) {
-                spi_master_tx(nixie_digits[j]);
-            }
-            /* Latch the data */
-            PORTC |= (1 << PC0);
-            _delay_us(1);
-            PORTC &= ~(1 << PC0);
-            
-            wave_cnt++;
-
-            _delay_ms(10);
-        } else if ((nixie_mode == NIXIE_SET_MODE) || (nixie_mode == NIXIE_SET_COUNT_MODE)) {
-            memset((void *)nixie_digits, 0x00, 8);
-            nixie_time_to_nixie_digits(time_setting, nixie_digits);
-            if (blink_sw) {
-                blank_digit(set_digit, nixie_digits);
-            }
-            for (j = sizeof(nixie_digits); j-- > 0; ) {
-                spi_master_tx(nixie_digits[j]);
-            }
-            /* Latch the data */
-            PORTC |= (1 << PC0);
-            _delay_us(1);
-            PORTC &= ~(1 << PC0);
-
-            sw_cnt++;
-            if (sw_cnt > 49) {
-                sw_cnt = 0;
-                blink_sw ^= 0x01;
-            }
+/* Tube animation and the display mode state machine, run every
+   10 ms */
+static void display_task(void) {
+    fsm_tick(&display_fsm);
+}
 
-            _delay_ms(10);
-        } else if (nixie_mode == NIXIE_DATE_MODE) {
-            ds3231_get_date(&the_date);
-            memset((void *)nixie_digits, 0x00, 8);
-            date_to_nixie_digits(the_date, nixie_digits);
+/* Display mode handlers */
 
-            for (j = sizeof(nixie_digits); j-- > 0; ) {
-                spi_master_tx(nixie_digits[j]);
-            }
-            /* Latch the data */
-            PORTC |= (1 << PC0);
-            _delay_us(1);
-            PORTC &= ~(1 << PC0);
-            
-            date_cnt++;
-            if (date_cnt > 199) {
-                date_cnt = 0;
-                nixie_mode = NIXIE_TEMP_MODE;
-                //nixie_mode = NIXIE_TIME_MODE;
+/* A second has passed (arg: uint8_t *, set if the pre-rendered frame
+   was latched) */
+static uint8_t time_event(uint8_t ev, const void *arg) {
+    if (ev != NIXIE_EV_SECOND) {
+        return 0;
+    }
+
+    if (!*(const uint8_t *)arg) {
+        time_to_nix_digits(the_time, &nixie_time);
+        memset((void *)nixie_digits, 0x00, sizeof(nixie_digits));
+        nixie_time_to_nixie_digits(nixie_time, nixie_digits);
+
+        /* Shifted out and latched from the SPI interrupt */
+        spi_frame_tx(nixie_digits);
+    }
+    return 1;
+}
+
+static uint8_t count_event(uint8_t ev, const void *arg) {
+    if (ev != NIXIE_EV_SECOND) {
+        return 0;
+    }
+
+    /* Packed BCD, borrow ripples up */
+    if (bcd_dec(&countdown_time.seconds, 0x59)) {
+        if (bcd_dec(&countdown_time.minutes, 0x59)) {
+            if (bcd_dec(&countdown_time.hours, 0x99)) {
+                countdown_time.hours = 0;
+                fsm_post(&display_fsm, NIXIE_BOUNCE_MODE);
             }
+        }
+    }
 
-            _delay_ms(10);
-        } else if (nixie_mode == NIXIE_TEMP_MODE) {
-            temp = ds3231_get_temp();
-            memset((void *)nixie_digits, 0x00, 8);
-            temp_to_nixie_digits(temp, nixie_digits);
+    if (countdown_time.seconds == 0) {
+        if ((countdown_time.minutes == 0) && 
+            (countdown_time.hours == 0)) {
+
+            fsm_post(&display_fsm, NIXIE_BOUNCE_MODE);
+        }
+    }
+
+    if (!*(const uint8_t *)arg) {
+        time_to_nix_digits(countdown_time, &nixie_time);
 
-            for (j = sizeof(nixie_digits); j-- > 0; ) {
-                spi_master_tx(nixie_digits[j]);
+        memset((void *)nixie_digits, 0x00, sizeof(nixie_digits));
+        nixie_time_to_nixie_digits(nixie_time, nixie_digits);
+
+        /* Shifted out and latched from the SPI interrupt */
+        spi_frame_tx(nixie_digits);
+    }
+    return 1;
+}
+
+static void wave_entry(void) {
+    k = 0;
+    wave_cnt = 0;
+}
+
+static void wave_tick(void) {
+    uint8_t j = 0;
+
+    nixie_clear(nixie_digits);
+    for (j = 0; j < NIXIE_TUBES; j++) {
+        nixie_set(nixie_digits, j, dig_loop[(k + j)%18]);
+    }
+        
+    if (wave_cnt > 4) {
+        k++;
+        wave_cnt = 0;
+    }
+
+    spi_frame_tx(nixie_digits);
+        
+    wave_cnt++;
+}
+
+static void date_entry(void) {
+    date_cnt = 0;
+}
+
+static void date_tick(void) {
+    /* From the once a second register snapshot */
+    if (ds3231_snapshot_seq) {
+        the_date.day = ds3231_snapshot.date.day;
+        the_date.month = ds3231_snapshot.date.month;
+        the_date.year = ds3231_snapshot.date.year;
+        memset((void *)nixie_digits, 0x00, 8);
+        date_to_nixie_digits(the_date, nixie_digits);
+
+        spi_frame_tx(nixie_digits);
+    }
+        
+    date_cnt++;
+    if (date_cnt > 199) {
+        fsm_post(&display_fsm, NIXIE_TEMP_MODE);
+    }
+}
+
+static void temp_tick(void) {
+    if (ds3231_snapshot_seq) {
+        memset((void *)nixie_digits, 0x00, 8);
+        temp_to_nixie_digits(ds3231_snapshot.temp, nixie_digits);
+
+        spi_frame_tx(nixie_digits);
+    }
+
+    date_cnt++;
+    if (date_cnt > 199) {
+        fsm_post(&display_fsm, NIXIE_TIME_MODE);
+    }
+}
+
+static void bounce_entry(void) {
+    bnc_sw = 0;
+    bnc_dig = 5;
+    bnc_cnt = 0;
+}
+
+static void bounce_tick(void) {
+    uint8_t j = 0;
+
+    memset((void *)nixie_digits, 0x00, 8);
+    nixie_time.tens_hours = 0;
+    nixie_time.hours = 0;
+    nixie_time.tens_minutes = 0;
+    nixie_time.minutes = 0;
+    nixie_time.tens_seconds = 0;
+    nixie_time.seconds = 0;
+
+    nixie_time_to_nixie_digits(nixie_time, nixie_digits);
+
+    for (j = 0; j < 6; j++) {
+        if (j != bnc_dig) {
+            nixie_blank(nixie_digits, j);
+        }
+    }
+
+    spi_frame_tx(nixie_digits);
+
+    bnc_cnt++;
+    if (bnc_cnt > 8) {
+        bnc_cnt = 0;
+
+        if (bnc_sw) {
+            bnc_dig++;
+            if (bnc_dig > 5) {
+                bnc_dig = 5;
+                bnc_sw = 0;
             }
-            /* Latch the data */
-            PORTC |= (1 << PC0);
-            _delay_us(1);
-            PORTC &= ~(1 << PC0);
-
-            date_cnt++;
-            if (date_cnt > 199) {
-                date_cnt = 0;
-                nixie_mode = NIXIE_TIME_MODE;
+        } else {
+            bnc_dig--;
+            if (bnc_dig > 5) {
+                bnc_dig = 0;
+                bnc_sw = 1;
             }
+        }
+    }
+}
 
-            _delay_ms(10);            
-        } else if (nixie_mode == NIXIE_BOUNCE_MODE) {
-            memset((void *)nixie_digits, 0x00, 8);
-            nixie_time.tens_hours = 0;
-            nixie_time.hours = 0;
-            nixie_time.tens_minutes = 0;
-            nixie_time.minutes = 0;
-            nixie_time.tens_seconds = 0;
-            nixie_time.seconds = 0;
-
-            nixie_time_to_nixie_digits(nixie_time, nixie_digits);
-
-            for (j = 0; j < 6; j++) {
-                if (j != bnc_dig) {
-                    blank_digit(j, nixie_digits);
-                }
-            }
+/* Switches outside the set modes (arg: sw_event_t *) */
+static uint8_t run_event(uint8_t ev, const void *arg) {
+    const sw_event_t *e = arg;
 
-            for (j = sizeof(nixie_digits); j-- > 0; ) {
-                spi_master_tx(nixie_digits[j]);
-            }
-            /* Latch the data */
-            PORTC |= (1 << PC0);
-            _delay_us(1);
-            PORTC &= ~(1 << PC0);
-
-            bnc_cnt++;
-            if (bnc_cnt > 8) {
-                bnc_cnt = 0;
-
-                if (bnc_sw) {
-                    bnc_dig++;
-                    if (bnc_dig > 5) {
-                        bnc_dig = 5;
-                        bnc_sw = 0;
-                    }
-                } else {
-                    bnc_dig--;
-                    if (bnc_dig > 5) {
-                        bnc_dig = 0;
-                        bnc_sw = 1;
-                    }
-                }
+    if (ev != NIXIE_EV_SWITCH) {
+        return 0;
+    }
+
+    if (e->pressed & SW_NEXT) {
+        /* Set date mode, clock will display date/temp */
+        fsm_post(&display_fsm, NIXIE_DATE_MODE);
+    } else if ((e->pressed | e->released) & SW_TUP) {
+        if ((e->state & 0x0f) == 0x0b) {
+            fsm_post(&display_fsm, NIXIE_WAVE_MODE);
+        }
+    } else if ((e->pressed | e->released) & SW_TDOWN) {
+        if ((e->state & 0x0f) == 0x07) {
+            fsm_post(&display_fsm, NIXIE_TIME_MODE);
+        }
+    }
+    return 1;
+}
+
+static void setting_entry(void) {
+    sw_cnt = 0;
+}
+
+static void setting_exit(void) {
+    set_digit = 5;
+    ui_repeat = 0;
+}
+
+/* Blink the digit being set */
+static void setting_tick(void) {
+    memset((void *)nixie_digits, 0x00, 8);
+    nixie_time_to_nixie_digits(time_setting, nixie_digits);
+    if (blink_sw) {
+        nixie_blank(nixie_digits, set_digit);
+    }
+    spi_frame_tx(nixie_digits);
+
+    sw_cnt++;
+    if (sw_cnt > 49) {
+        sw_cnt = 0;
+        blink_sw ^= 0x01;
+    }
+}
+
+/* Digit select and up/down (with auto-repeat) in both set modes */
+static uint8_t setting_event(uint8_t ev, const void *arg) {
+    const sw_event_t *e = arg;
+
+    if (ev != NIXIE_EV_SWITCH) {
+        return 0;
+    }
+
+    if (e->pressed & SW_NEXT) {
+        set_digit--;
+        if (set_digit > 5) {
+            set_digit = 5;
+        }
+
+        /* Check and adjust all digits to meet time limits */
+        if (time_setting.tens_hours == 2) {
+            if (time_setting.hours > 3) {
+                time_setting.hours = 0;
             }
+        }
+    } else if (e->pressed & SW_TUP) {
+        set_digit_up();
+        ui_repeat = SW_TUP;
+        ui_repeat_tick = e->tick + UI_REPEAT_DELAY_MS;
+    } else if (e->pressed & SW_TDOWN) {
+        set_digit_down();
+        ui_repeat = SW_TDOWN;
+        ui_repeat_tick = e->tick + UI_REPEAT_DELAY_MS;
+    }
+    return 1;
+}
+
+static void set_entry(void) {
+    time_to_nix_digits(the_time, &time_setting);
+}
+
+/* Letting go of TSET sets the time */
+static uint8_t set_event(uint8_t ev, const void *arg) {
+    const sw_event_t *e = arg;
+
+    if ((ev != NIXIE_EV_SWITCH) || !((e->pressed | e->released) & SW_TSET)) {
+        return 0;
+    }
 
-            _delay_ms(10);
+    /* Check and adjust all digits to meet time limits */
+    if (time_setting.tens_hours == 2) {
+        if (time_setting.hours > 3) {
+            time_setting.hours = 0;
         }
+    }
 
+    if (clock_fsm.state == GPS_FIX_NONE) {
+        fsm_post(&clock_fsm, MAN_SET_TIME);
+    }
 
-        /* USB rx commands */
-        if (USB_DeviceState == DEVICE_STATE_Configured) {
-            /* Must throw away unused bytes from the host, or it will lock
-               up while waiting for the device */
-            rx_num_bytes = CDC_Device_BytesReceived(&VirtualSerial_CDC_Interface);
-            if (rx_num_bytes > 0) {
-                for (i = 0; i < rx_num_bytes; i++) {
-                    // we'll need a nice buffer for these in the future...
-                    my_byte = CDC_Device_ReceiveByte(&VirtualSerial_CDC_Interface);
-                }
+    fsm_post(&display_fsm, NIXIE_TIME_MODE);
+    return 1;
+}
 
-                if ((char)my_byte == 'p') {
-                    e_stat = ds3231_print_info(sbuf);
-                    sw = 0;
-                    if (!e_stat) {
-                        //sw = 0;
-                        //memset(sbuf, 0x00, sizeof(sbuf));
+static void set_count_entry(void) {
+    PORTC |= (1 << PC7);
+    time_setting.tens_hours = 0;
+    time_setting.hours = 0;
+    time_setting.tens_minutes = 0;
+    time_setting.minutes = 0;
+    time_setting.tens_seconds = 0;
+    time_setting.seconds = 0;
+}
+
+static void set_count_exit(void) {
+    PORTC &= ~(1 << PC7);
+}
+
+/* Letting go of TSET starts the countdown */
+static uint8_t set_count_event(uint8_t ev, const void *arg) {
+    const sw_event_t *e = arg;
+
+    if ((ev != NIXIE_EV_SWITCH) || !((e->pressed | e->released) & SW_TSET)) {
+        return 0;
+    }
+
+    /* Packed BCD, the digits are at most 9 so each pair stays within
+       0x99 */
+    countdown_time.hours = (time_setting.tens_hours << 4) | time_setting.hours;
+    countdown_time.minutes = (time_setting.tens_minutes << 4) | time_setting.minutes;
+    countdown_time.seconds = (time_setting.tens_seconds << 4) | time_setting.seconds;
+
+    if ((countdown_time.hours + countdown_time.minutes + countdown_time.seconds) == 0) {
+        fsm_post(&display_fsm, NIXIE_TIME_MODE);
+    } else {
+        fsm_post(&display_fsm, NIXIE_COUNT_MODE);
+    }
+    return 1;
+}
+
+/* USB debug commands */
+static void usb_cmd_task(void) {
+    static char sbuf[255];
+    static uint8_t sw = 0;
+    uint8_t my_byte = 0;
+    uint16_t rx_num_bytes = 0;
+    uint16_t i = 0;
+    uint16_t j = 0;
+    uint8_t cdc_dev_status = 0;
+    uint8_t e_stat = 0;
+    timebase_time_t now;
+    nixie_time_t now_time;
+
+    /* USB rx commands */
+    if (USB_DeviceState == DEVICE_STATE_Configured) {
+        /* Must throw away unused bytes from the host, or it will lock
+           up while waiting for the device */
+        rx_num_bytes = CDC_Device_BytesReceived(&VirtualSerial_CDC_Interface);
+        if (rx_num_bytes > 0) {
+            for (i = 0; i < rx_num_bytes; i++) {
+                // we'll need a nice buffer for these in the future...
+                my_byte = CDC_Device_ReceiveByte(&VirtualSerial_CDC_Interface);
+            }
+
+            if ((char)my_byte == 'p') {
+                e_stat = ds3231_print_info(sbuf);
+                sw = 0;
+                if (!e_stat) {
+                    //sw = 0;
+                    //memset(sbuf, 0x00, sizeof(sbuf));
+                }
+                my_byte = 0x00;
+            } else if ((char)my_byte == 't') {
+                /* From the once a second register snapshot, packed
+                   BCD */
+                e_stat = (ds3231_snapshot_seq == 0);
+                sprintf(sbuf, "%02x:%02x:%02x\n", ds3231_snapshot.time.hours,
+                        ds3231_snapshot.time.minutes, ds3231_snapshot.time.seconds);
+                sw = 0;
+                my_byte = 0x00;
+            } else if ((char)my_byte == 'g') {
+                if (dtr_status) {
+                    sprintf(sbuf, "%02x:%02x:%02x\n", the_time.hours, the_time.minutes, the_time.seconds);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "GPS FIX: ");
+                    itoa(gps_fix, sbuf, 10);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    //cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(gps_fix, sbuf, 10));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, gps_time_s);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, " ");
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, gps_talker);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
+                    sprintf(sbuf, "%02i-%02i-%02i\n", gps_date.year, gps_date.month, gps_date.day);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    sprintf(sbuf, "PPS->RMC: %lu us\n", mtk3339_pps_latency/(F_CPU/1000000UL));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "GSA packets: ");
+                    itoa(gpgsa, sbuf, 10);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                }
+            } else if ((char)my_byte == 'n') {
+                if (dtr_status) {
+                    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                        timebase_now(&now);
+                        now_time.hours = the_time.hours;
+                        now_time.minutes = the_time.minutes;
+                        now_time.seconds = the_time.seconds;
                     }
-                    my_byte = 0x00;
-                } else if ((char)my_byte == 't') {
-                    e_stat = ds3231_get_time_digits(&nixie_time);
-                    sprintf(sbuf, "%i%i:%i%i:%i%i\n", nixie_time.tens_hours,
-                            nixie_time.hours, nixie_time.tens_minutes, nixie_time.minutes,
-                            nixie_time.tens_seconds, nixie_time.seconds);
-                    sw = 0;
-                    my_byte = 0x00;
-                } else if ((char)my_byte == 'g') {
-                    if (dtr_status) {
-                        sprintf(sbuf, "%02i:%02i:%02i\n", the_time.hours, the_time.minutes, the_time.seconds);
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
-                        memset(sbuf, 0x00, sizeof(sbuf));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "GPS FIX: ");
-                        itoa(gps_fix, sbuf, 10);
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
-                        //cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(gps_fix, sbuf, 10));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, gps_time_s);
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
-                        sprintf(sbuf, "%02i-%02i-%02i\n", gps_date.year, gps_date.month, gps_date.day);
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
-                        memset(sbuf, 0x00, sizeof(sbuf));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "GSA packets: ");
-                        itoa(gpgsa, sbuf, 10);
+                    sprintf(sbuf, "%02x:%02x:%02x.%06lu\nPeriod: %lu\n", now_time.hours,
+                            now_time.minutes, now_time.seconds, now.micros, timebase_period);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                }
+            } else if ((char)my_byte == 'h') {
+                if (dtr_status) {
+                    sprintf(sbuf, "State: %i tau: %i\nCPU: %li ppb\nRTC: %li ppb\nPhase: %li\nOffset: %li\nHoldover: %u s\n",
+                            discipline_state, discipline_tau,
+                            discipline_ppb(discipline_cpu_freq),
+                            discipline_ppb(discipline_rtc_freq),
+                            discipline_phase, discipline_offset, discipline_holdover);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    sprintf(sbuf, "Aging: %i steps: %u window: %u s last: %li ppb\n",
+                            ds3231_cal_aging, ds3231_cal_steps, ds3231_cal_count, ds3231_cal_ppb);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    j = sprintf(sbuf, "Temp: ");
+                    j += ds3231_format_temp(sbuf + j, ds3231_drift_temp);
+                    sprintf(sbuf + j, " C drift: %i ppb\n", ds3231_drift_ppb);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                }
+            } else if ((char)my_byte == 'b') {
+                if (dtr_status) {
+                    sprintf(sbuf, "Profile: %i\nAcquire: %u B/s\nSteady: %u B/s\n", mtk3339_profile,
+                            mtk3339_profile_rate[MTK3339_PROFILE_ACQUIRE],
+                            mtk3339_profile_rate[MTK3339_PROFILE_STEADY]);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                }
+            } else if ((char)my_byte == 's') {
+                if (dtr_status) {
+                    sprintf(sbuf, "Duty: %u/1000\n", sched_duty);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    /* Worst case in CPU ticks, table order */
+                    for (j = 0; j < SCHED_TASKS; j++) {
+                        sprintf(sbuf, "Task %u runs: %lu late: %u worst: %lu\n", j,
+                                sched_stats[j].runs, sched_stats[j].late,
+                                sched_stats[j].worst);
                         cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
-                        memset(sbuf, 0x00, sizeof(sbuf));
-                    }
-                } else if ((char)my_byte == 'r') {
-                    mtk3339_set_output_rmc();
-                } else if ((char)my_byte == 'd') {
-                    mtk3339_set_output_default();
-                } else if ((char)my_byte == 'l') {
-                    if (dtr_status) {
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(pgtop, sbuf, 10));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
-                        memset(sbuf, 0x00, sizeof(sbuf));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(npackets, sbuf, 10));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
-                        memset(sbuf, 0x00, sizeof(sbuf));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(uart_rx_overflow, sbuf, 10));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
-                        memset(sbuf, 0x00, sizeof(sbuf));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(RingBuffer_GetCount(&uart_buf), sbuf, 10));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
-                        memset(sbuf, 0x00, sizeof(sbuf));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(pmtk_ack, sbuf, 10));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
-                        memset(sbuf, 0x00, sizeof(sbuf));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(seconds_cnt, sbuf, 10));
-                        cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
                         memset(sbuf, 0x00, sizeof(sbuf));
                     }
-                } else if ((char)my_byte == 'u') {
-                    /* mtk3339 debug stuff.. */
-                    // uart_disable();
-                    // uart_flush_buffer();
-                    // nmea_flush();
-                    // uart_init(57600);
-                } else if ((char)my_byte == 'i') {
-                    if (nixie_mode != NIXIE_SET_MODE) {
-                        nixie_mode = NIXIE_WAVE_MODE;
-                    }
-                } else if ((char)my_byte == 'o') {
-                    if (nixie_mode != NIXIE_SET_MODE) {
-                        nixie_mode = NIXIE_TIME_MODE;
-                    }
-                } else if ((char)my_byte == 'k') {
-                    /* debug for switches */
-                    sprintf(sbuf, "PA: %02x\n", pa);
-                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                }
+            } else if ((char)my_byte == 'r') {
+                /* Output goes through the profiles so the manager
+                   knows what the module is sending. The next fix
+                   lock/loss puts the clock's choice back. */
+                mtk3339_set_profile(MTK3339_PROFILE_STEADY);
+            } else if ((char)my_byte == 'd') {
+                mtk3339_set_profile(MTK3339_PROFILE_ACQUIRE);
+            } else if ((char)my_byte == 'l') {
+                if (dtr_status) {
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(pgtop, sbuf, 10));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(npackets, sbuf, 10));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(uart_rx_overflow, sbuf, 10));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
                     memset(sbuf, 0x00, sizeof(sbuf));
-                    sprintf(sbuf, "test: %02x\n", test);
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(uart_rx_pending(), sbuf, 10));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(pmtk_ack, sbuf, 10));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, itoa(seconds_cnt, sbuf, 10));
+                    cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "\n");
+                    memset(sbuf, 0x00, sizeof(sbuf));
+                    sprintf(sbuf, "PMTK timeouts: %i nacks: %i queued: %i\n", pmtk_timeouts, pmtk_nacks, mtk3339_busy());
                     cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
                     memset(sbuf, 0x00, sizeof(sbuf));
-                    sprintf(sbuf, "HV: %02x\n", hv);
+                    sprintf(sbuf, "TWI nacks: %u timeouts: %u recoveries: %u failures: %u last: %i\n",
+                            TWI_nacks, TWI_timeouts, TWI_recoveries, TWI_failures, TWI_error);
                     cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
                     memset(sbuf, 0x00, sizeof(sbuf));
-                }
-
-            }
-            
-
-            /* Only write data if the host is reading */
-            if (dtr_status) {
-                // we can send stuff to usb.
-                if (sw == 0) {
-                    //cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "HELLO WORLD!");
-                    //cdc_dev_status = CDC_Device_SendData(&VirtualSerial_CDC_Interface, TWI_buffer_in, 19);
-                    //cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "MESSAGE TIME\n");
+                    sprintf(sbuf, "Baud: %lu state: %i\n", mtk3339_baud, mtk3339_baud_state);
                     cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
                     memset(sbuf, 0x00, sizeof(sbuf));
-                    //cdc_dev_status = Cget multiple bytesDC_Device_SendData(&VirtualSerial_CDC_Interface, memwad, 19);
-                    sw = 1;
                 }
-
+            } else if ((char)my_byte == 'u') {
+                /* mtk3339 debug stuff.. */
+                // uart_disable();
+                // uart_flush_buffer();
+                // nmea_flush();
+                // uart_init(57600);
+            } else if ((char)my_byte == 'i') {
+                if (display_fsm.state != NIXIE_SET_MODE) {
+                    fsm_post(&display_fsm, NIXIE_WAVE_MODE);
+                }
+            } else if ((char)my_byte == 'o') {
+                if (display_fsm.state != NIXIE_SET_MODE) {
+                    fsm_post(&display_fsm, NIXIE_TIME_MODE);
+                }
+            } else if ((char)my_byte == 'k') {
+                /* debug for switches */
+                sprintf(sbuf, "PA: %02x lost: %u\n", sw_state, sw_overflows);
+                cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                memset(sbuf, 0x00, sizeof(sbuf));
+                sprintf(sbuf, "test: %02x\n", test);
+                cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                memset(sbuf, 0x00, sizeof(sbuf));
+                sprintf(sbuf, "HV: %02x\n", hv);
+                cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                memset(sbuf, 0x00, sizeof(sbuf));
             }
+
         }
         
-        // /* Some test stuff for HV5522 current */
-        // /* blast some data to HV5522s */
-        // for (j = 0; j < 8; j++) {
-        //     spi_master_tx(0x00);
-        // }
-        // /* Latch! */
-        // PORTC |= (1 << PC0);
-        // _delay_us(1);
-        // PORTC &= ~(1 << PC0);
-
-        uart_task();
-        CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
-        USB_USBTask();
+
+        /* Only write data if the host is reading */
+        if (dtr_status) {
+            // we can send stuff to usb.
+            if (sw == 0) {
+                //cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "HELLO WORLD!");
+                //cdc_dev_status = CDC_Device_SendData(&VirtualSerial_CDC_Interface, TWI_buffer_in, 19);
+                //cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, "MESSAGE TIME\n");
+                cdc_dev_status = CDC_Device_SendString(&VirtualSerial_CDC_Interface, sbuf);
+                memset(sbuf, 0x00, sizeof(sbuf));
+                //cdc_dev_status = Cget multiple bytesDC_Device_SendData(&VirtualSerial_CDC_Interface, memwad, 19);
+                sw = 1;
+            }
+
+        }
     }
 }
 
+/* GPS receive and NMEA parsing */
+static void nmea_task(void) {
+    uart_task();
+    mtk3339_task();
+}
+
+/* LUFA housekeeping */
+static void usb_task(void) {
+    CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
+    USB_USBTask();
+}
+
 
 /* Configures the board hardware and chip peripherals for the demo's
    functionality. */
@@ -611,6 +1009,14 @@ void setup_hardware(void) {
     /* Disable clock division */
     clock_prescale_set(clock_div_1);
 
+    /* Unused peripherals off, they'd otherwise keep clocking through
+       idle sleep. The USB clock and PLL are frozen by LUFA while
+       VBUS is away. */
+    power_adc_disable();
+    power_timer2_disable();
+    power_timer3_disable();
+    ACSR |= (1 << ACD);
+
     /* LED0 to output */
     DDRC |= (1 << PC4) | (1 << PC5) | (1 << PC6) | (1 << PC7);
     /* LED off! */
@@ -622,7 +1028,7 @@ void setup_hardware(void) {
     /* init spi (for HV5522s) */
     spi_init();
 
-    /* Set all filaments off */
+    /* Set all filaments off (interrupts are still off, so block) */
     for (i = sizeof(nixie_digits); i-- > 0; ) {
         spi_master_tx(nixie_digits[i]);
     }
@@ -640,121 +1046,147 @@ void setup_hardware(void) {
     /* init TWI */
     TWI_init();
 
+    /* 1 kHz tick for timeouts */
+    tick_init();
+
+    /* Free running timer for timestamping PPS edges and sentences */
+    timebase_init();
+    discipline_init();
+
     /* init uart */
     uart_init_buffer();
     uart_init(MTK3339_DEFAULT_BAUD);
 
     mtk3339_hw_init();
 
-    /* MAX6818 stuff */
-    DDRC |= (1 << PC2);
-
-    PORTC |= (1 << PC2);
-    _delay_us(1);
-    PORTC &= ~(1 << PC2);
-    _delay_us(1);
-    PORTC |= (1 << PC2);
-
-    /* Set port A as input */
-    DDRA = 0x00;
-    pa = (PINA & 0x1f);
-    pa_store = pa;
-    /* Set pcint5 as input */
-    DDRB &= ~(1 << PB5);
-
-    PCICR |= (1 << PCIE0);
-    /* Only using max6818 interrupt for now */
-    PCMSK0 |= (1 << PCINT5);
+    /* MAX6818 switch debouncer */
+    sw_init();
 }
 
-/* Call to increment by one second */
-void increment_time(void) {
-    uint8_t j = 0;
-    seconds_cnt++;
-    the_time.seconds++;
-    if (the_time.seconds > 59) {
-        the_time.minutes++;
-        the_time.seconds = 0;
-    }
-    
-    if (the_time.minutes > 59) {
-        the_time.hours++;
-        the_time.minutes = 0;
-    }
-    
-    if (the_time.hours > 23) {
-        the_time.hours = 0;
+/* Call to increment by one second. latched is set if the PPS ISR
+   already put the pre-rendered frame up. */
+void increment_time(uint8_t latched) {
+    volatile nixie_time_t *base = &the_time;
+
+    if (display_fsm.state == NIXIE_COUNT_MODE) {
+        base = &countdown_time;
     }
 
-    //time_to_nix_digits(the_time, &nixie_time);
+    /* A frame built from a time, mode or hold state that changed
+       since is only up for the few us until the render below
+       replaces it */
+    if (latched && !((frame_mode == display_fsm.state) &&
+                     (frame_hold == (discipline_slip < 0)) &&
+                     time_equal(&frame_base, base))) {
+        latched = 0;
+    }
+    spi_frame_armed = 0;
 
-    /* Display on tubes if we're in time mode */
-    if (nixie_mode == NIXIE_TIME_MODE) {
-        time_to_nix_digits(the_time, &nixie_time);
-        /* Insert next two lines into display only code */
-        memset((void *)nixie_digits, 0x00, sizeof(nixie_digits));
-        nixie_time_to_nixie_digits(nixie_time, nixie_digits);
+    /* Holdover running ahead by a second, hold this one */
+    if (discipline_slip < 0) {
+        discipline_slip++;
+        return;
+    }
 
-        /* blast some data to HV5522s (reverse order, 10s hours first,
-           seconds last */
-        for (j = sizeof(nixie_digits); j-- > 0; ) {
-            spi_master_tx(nixie_digits[j]);
+    seconds_cnt++;
+    /* Packed BCD, carry ripples up a digit pair at a time */
+    if (bcd_inc(&the_time.seconds, 0x59)) {
+        if (bcd_inc(&the_time.minutes, 0x59)) {
+            bcd_inc(&the_time.hours, 0x23);
         }
-        /* Latch the data */
-        PORTC |= (1 << PC0);
-        _delay_us(1);
-        PORTC &= ~(1 << PC0);
     }
 
-    if (nixie_mode == NIXIE_COUNT_MODE) {
-        countdown_time.seconds--;
+    /* Let the display mode show it, latched tells it whether the
+       pre-rendered frame is already up */
+    fsm_event(&display_fsm, NIXIE_EV_SECOND, &latched);
+}
+
+static inline uint8_t time_equal(nixie_time_t *a, volatile nixie_time_t *b) {
+    return((a->seconds == b->seconds) && (a->minutes == b->minutes) &&
+           (a->hours == b->hours));
+}
 
-        if (countdown_time.seconds == 0) {
-            if ((countdown_time.minutes == 0) && 
-                (countdown_time.hours == 0)) {
+/* Leaving a mode that pre-renders, keep the edge off its frame */
+static void frame_disarm(void) {
+    spi_frame_armed = 0;
+}
 
-                nixie_mode = NIXIE_BOUNCE_MODE;
-            }
+/* Build what increment_time() will show at the next edge and shift it
+   in unlatched. Runs from the main loop, redoes the frame whenever
+   the time is changed under it. */
+static void frame_prerender(void) {
+    nixie_time_t cur;
+    nixie_time_t next;
+    nixie_time_digits_t digits;
+    uint8_t frame[NIXIE_FRAME_BYTES];
+    uint8_t m = display_fsm.state;
+    uint8_t hold = 0;
+    volatile nixie_time_t *base = &the_time;
+
+    if ((m != NIXIE_TIME_MODE) && (m != NIXIE_COUNT_MODE)) {
+        return;
+    }
+    if (m == NIXIE_COUNT_MODE) {
+        base = &countdown_time;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        hold = (discipline_slip < 0);
+        if (spi_frame_armed && (frame_mode == m) && (frame_hold == hold) &&
+            time_equal(&frame_base, base) &&
+            (spi_frame_loaded || !spi_frame_done)) {
+            return;
         }
+        cur.seconds = base->seconds;
+        cur.minutes = base->minutes;
+        cur.hours = base->hours;
+    }
+
+    next = cur;
 
-        if (countdown_time.seconds == 255) {
-            countdown_time.seconds = 59;
-            countdown_time.minutes--;
-            if (countdown_time.minutes == 255) {
-                countdown_time.minutes = 59;
-                countdown_time.hours--;
-                if (countdown_time.hours == 255) {
-                    countdown_time.hours = 0;
-                    nixie_mode = NIXIE_BOUNCE_MODE;
+    if (!hold) {
+        if (m == NIXIE_TIME_MODE) {
+            if (bcd_inc(&next.seconds, 0x59)) {
+                if (bcd_inc(&next.minutes, 0x59)) {
+                    bcd_inc(&next.hours, 0x23);
+                }
+            }
+        } else {
+            if (bcd_dec(&next.seconds, 0x59)) {
+                if (bcd_dec(&next.minutes, 0x59)) {
+                    if (bcd_dec(&next.hours, 0x99)) {
+                        next.hours = 0;
+                    }
                 }
             }
         }
+    }
 
-        time_to_nix_digits(countdown_time, &nixie_time);
-
-        memset((void *)nixie_digits, 0x00, sizeof(nixie_digits));
-        nixie_time_to_nixie_digits(nixie_time, nixie_digits);
-
-        /* blast some data to HV5522s (reverse order, 10s hours first,
-           seconds last */
-        for (j = sizeof(nixie_digits); j-- > 0; ) {
-            spi_master_tx(nixie_digits[j]);
+    time_to_nix_digits(next, &digits);
+    nixie_time_to_nixie_digits(digits, frame);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        /* Only if no edge got in while rendering, otherwise try again
+           next pass */
+        if ((display_fsm.state == m) && ((discipline_slip < 0) == hold) &&
+            time_equal(&cur, base)) {
+            spi_frame_load(frame);
+            frame_base = cur;
+            frame_mode = m;
+            frame_hold = hold;
+            spi_frame_armed = 1;
         }
-        /* Latch the data */
-        PORTC |= (1 << PC0);
-        _delay_us(1);
-        PORTC &= ~(1 << PC0);
-
     }
 }
 
 static void set_system_time(nixie_time_digits_t t) {
-    if ((mode != GPS_FIX_STABLE) && (mode != GPS_FIX_CHECK_TIME)) {
-        the_time.seconds = t.tens_seconds*10 + t.seconds;
-        the_time.minutes = t.tens_minutes*10 + t.minutes;
-        the_time.hours = t.tens_hours*10 + t.hours;
-        
-        ds3231_set_time(the_time);
+    if ((clock_fsm.state != GPS_FIX_STABLE) && (clock_fsm.state != GPS_FIX_CHECK_TIME)) {
+        the_time.seconds = (t.tens_seconds << 4) | t.seconds;
+        the_time.minutes = (t.tens_minutes << 4) | t.minutes;
+        the_time.hours = (t.tens_hours << 4) | t.hours;
+
+        /* Queued, the bus finishes it in the background */
+        ds3231_set_time_async(the_time);
     }
 }
 
@@ -774,124 +1206,94 @@ static inline uint8_t dectobcd(uint8_t k) {
     return((k/10)*16 + (k%10));
 }
 
+/* Increment a packed BCD pair, wrapping to 0 past max. Returns 1 on
+   wrap (carry). */
+static inline uint8_t bcd_inc(volatile uint8_t *v, uint8_t max) {
+    uint8_t x = *v + 1;
+
+    if ((x & 0x0f) > 0x09) {
+        x += 0x06;
+    }
+    if (x > max) {
+        *v = 0;
+        return 1;
+    }
+    *v = x;
+    return 0;
+}
+
+/* Decrement a packed BCD pair, wrapping from 0 to max. Returns 1 on
+   wrap (borrow). */
+static inline uint8_t bcd_dec(volatile uint8_t *v, uint8_t max) {
+    uint8_t x = *v;
+
+    if (x == 0) {
+        *v = max;
+        return 1;
+    }
+    x--;
+    if ((x & 0x0f) == 0x0f) {
+        x -= 0x06;
+    }
+    *v = x;
+    return 0;
+}
+
+/* GPS UTC (binary) to local packed BCD time, only used outside the
+   ISRs */
+static void gps_to_local_time(gps_rmc_time_t g, nixie_time_t *t) {
+    t->hours = dectobcd(tmod(g.hours - 7));
+    t->minutes = dectobcd(g.minutes);
+    t->seconds = dectobcd(g.seconds);
+}
+
+/* the time is already packed BCD, the digits are just its nibbles */
 static inline void time_to_nix_digits(nixie_time_t t, nixie_time_digits_t *td) {
-    uint8_t p = 0;
-    p = dectobcd(t.seconds);
-    td->seconds = (p & 0x0f);
-    td->tens_seconds = ((p >> 4) & 0x0f);
-    p = dectobcd(t.minutes);
-    td->minutes = (p & 0x0f);
-    td->tens_minutes = ((p >> 4) & 0x0f);
-    p = dectobcd(t.hours);
-    td->hours = (p & 0x0f);
-    td->tens_hours = ((p >> 4) & 0x0f);
+    td->seconds = (t.seconds & 0x0f);
+    td->tens_seconds = (t.seconds >> 4);
+    td->minutes = (t.minutes & 0x0f);
+    td->tens_minutes = (t.minutes >> 4);
+    td->hours = (t.hours & 0x0f);
+    td->tens_hours = (t.hours >> 4);
 }
 
 static void date_to_nixie_digits(nixie_date_t d, volatile uint8_t *nd) {
     if (nd != 0) {
-        memset((void *)nd, 0x00, 8);
-        uint8_t n = 0;
-        uint8_t temp = 0x00;
-
-        temp = dectobcd(d.day);
-        n = SEC_OS + (temp & 0x0f);
-        nd[n/8] = (1 << n%8);
-        n = TENS_SEC_OS + ((temp & 0xf0) >> 4);
-        nd[n/8] |= (1 << n%8);
-
-        temp = dectobcd(d.month);
-        n = MIN_OS + (temp & 0x0f);
-        nd[n/8] |= (1 << n%8);
-        n = TENS_MIN_OS + ((temp & 0xf0) >> 4);
-        nd[n/8] |= (1 << n%8);
-
-        temp = dectobcd(d.year);
-        n = HR_OS + (temp & 0x0f);
-        nd[n/8] |= (1 << n%8);
-        n = TENS_HR_OS + ((temp & 0xf0) >> 4);
-        nd[n/8] |= (1 << n%8);
+        nixie_clear(nd);
+        nixie_set_bcd(nd, NIXIE_SEC, dectobcd(d.day));
+        nixie_set_bcd(nd, NIXIE_MIN, dectobcd(d.month));
+        nixie_set_bcd(nd, NIXIE_HR, dectobcd(d.year));
     }
 }
 
-static void temp_to_nixie_digits(float temp, volatile uint8_t *nd) {
-    if (nd != 0) {
-        memset((void *)nd, 0x00, 8);
-        uint8_t n = 0;
-        
-        uint8_t c = 0;
-        uint8_t d = 0;
+/* Hundredths of a degree for each quarter, as BCD */
+static const uint8_t temp_frac_bcd[4] = {0x00, 0x25, 0x50, 0x75};
 
-        uint8_t bcd = 0;
-
-        /* Split temperature into two ints */
-        c = (uint8_t)temp;
-        d = fmod(round(temp*100.0), 100.0);
-
-        bcd = dectobcd(d);
-        
-        n = MIN_OS + (bcd & 0x0f);
-        nd[n/8] |= (1 << n%8);
-        n = TENS_MIN_OS + ((bcd & 0xf0) >> 4);
-        nd[n/8] |= (1 << n%8);
+/* temp is Q8.2 (quarter degrees), the tubes show |temp| as cc.dd */
+static void temp_to_nixie_digits(int16_t temp, volatile uint8_t *nd) {
+    if (nd != 0) {
+        nixie_clear(nd);
 
-        bcd = dectobcd(c);
+        if (temp < 0) {
+            temp = -temp;
+        }
 
-        n = HR_OS + (bcd & 0x0f);
-        nd[n/8] |= (1 << n%8);
-        n = TENS_HR_OS + ((bcd & 0xf0) >> 4);
-        nd[n/8] |= (1 << n%8);
+        /* Whole degrees on the hours, quarters on the minutes */
+        nixie_set_bcd(nd, NIXIE_MIN, temp_frac_bcd[temp & 0x03]);
+        nixie_set_bcd(nd, NIXIE_HR, dectobcd((uint8_t)(temp >> 2)));
     }
 }
 
 /* nd should be an array of bytes of at least size 8 */    
 static inline void nixie_time_to_nixie_digits(nixie_time_digits_t t, volatile uint8_t *nd) {
     if (nd != 0) {
-        memset((void *)nd, 0x00, 8);
-        uint8_t n = 0;
-        n = SEC_OS + t.seconds;
-        nd[n/8] = (1 << n%8);
-        n = TENS_SEC_OS + t.tens_seconds;
-        nd[n/8] |= (1 << n%8);
-        n = MIN_OS + t.minutes;
-        nd[n/8] |= (1 << n%8);
-        n = TENS_MIN_OS + t.tens_minutes;
-        nd[n/8] |= (1 << n%8);
-        n = HR_OS + t.hours;
-        nd[n/8] |= (1 << n%8);
-        n = TENS_HR_OS + t.tens_hours;
-        nd[n/8] |= (1 << n%8);
-    }
-}
-
-/* nd must be an array of bytes of at least size 8 */
-static inline void blank_digit(uint8_t dig, volatile uint8_t *nd) {
-    switch (dig) {
-    case 0:
-        nd[0] = 0x00;
-        nd[1] &= ~(0x03);
-        break;
-    case 1:
-        nd[1] &= ~(0xfc);
-        nd[2] &= ~(0x0f);
-        break;
-    case 2:
-        nd[2] &= ~(0xf0);
-        nd[3] &= ~(0x3f);
-        break;
-    case 3:
-        nd[4] = 0x00;
-        nd[5] &= ~(0x03);
-        break;
-    case 4:
-        nd[5] &= ~(0xfc);
-        nd[6] &= ~(0x0f);
-        break;
-    case 5:
-        nd[6] &= ~(0xf0);
-        nd[7] &= ~(0x3f);
-        break;
-    default:
-        break;
+        nixie_clear(nd);
+        nixie_set(nd, NIXIE_SEC, t.seconds);
+        nixie_set(nd, NIXIE_TENS_SEC, t.tens_seconds);
+        nixie_set(nd, NIXIE_MIN, t.minutes);
+        nixie_set(nd, NIXIE_TENS_MIN, t.tens_minutes);
+        nixie_set(nd, NIXIE_HR, t.hours);
+        nixie_set(nd, NIXIE_TENS_HR, t.tens_hours);
     }
 }
 
@@ -940,226 +1342,140 @@ void EVENT_CDC_Device_ControLineStateChanged(USB_ClassInfo_CDC_Device_t* const C
     dtr_status = CurrentDTRState;
 }
 
-ISR(PCINT0_vect) {
-    uint8_t temp = 0x00;
-
-    if (!(PINB & 0x20)) {
-
-        /* EN on max6818 */
-        PORTC &= ~(1 << PC2);
-        _delay_us(1);
-
-        /* Read pins */
-        pa = (PINA & 0x1f);
-        temp = pa ^ pa_store;
-        test = temp;
-
-        if (pcnt_lktb[temp] == 1) {
-            switch(temp) {
-            case SW_TSET:
-
-                //if (!(pa & SW_TSET)) {
-                if ((pa & 0x0f) == (~SW_TSET & 0x0f)) {
-                    //PORTC |= (1 << PC7);
-                    time_to_nix_digits(the_time, &time_setting);
-                    nixie_mode = NIXIE_SET_MODE;
-                } else if ((pa & 0x0f) == (~(SW_TSET | SW_NEXT) & 0x0f)) {
-                    PORTC |= (1 << PC7);
-                    nixie_mode = NIXIE_SET_COUNT_MODE;
-                    time_setting.tens_hours = 0;
-                    time_setting.hours = 0;
-                    time_setting.tens_minutes = 0;
-                    time_setting.minutes = 0;
-                    time_setting.tens_seconds = 0;
-                    time_setting.seconds = 0;
-                } else {
-                    if (nixie_mode == NIXIE_SET_MODE) {
-                        PORTC &= ~(1 << PC7);
-                        /* Check and adjust all digits to meet time limits */
-                        if (time_setting.tens_hours == 2) {
-                            if (time_setting.hours > 3) {
-                                time_setting.hours = 0;
-                            }
-                        }
-
-                        set_digit = 5;
-                    
-                        //set_system_time(time_setting);
-                        if (mode == GPS_FIX_NONE) {
-                            mode = MAN_SET_TIME;
-                        }
-                    
-                        nixie_mode = NIXIE_TIME_MODE;
-                    } else if (nixie_mode == NIXIE_SET_COUNT_MODE) {
-                        PORTC &= ~(1 << PC7);
-                        countdown_time.hours = time_setting.tens_hours*10 + time_setting.hours;
-                        countdown_time.minutes = time_setting.tens_minutes*10 + time_setting.minutes;
-                        countdown_time.seconds = time_setting.tens_seconds*10 + time_setting.seconds;
-                        set_digit = 5;
-
-                        if (countdown_time.seconds > 99) {
-                            countdown_time.seconds = 99;
-                        }
-
-                        if (countdown_time.minutes > 99) {
-                            countdown_time.minutes = 99;
-                        }
-
-                        if (countdown_time.hours > 99) {
-                            countdown_time.hours = 99;
-                        }
-
-
-                        if ((countdown_time.hours + countdown_time.minutes + countdown_time.seconds) == 0) {
-                            nixie_mode = NIXIE_TIME_MODE;
-                        } else {
-                            nixie_mode = NIXIE_COUNT_MODE;
-                        }
-                    }
-                }
-                break;
-            case SW_NEXT:
-                if ((nixie_mode == NIXIE_SET_MODE) || (nixie_mode == NIXIE_SET_COUNT_MODE)) {
-                    if (!(pa & SW_NEXT)) {
-                        set_digit--;
-                        if (set_digit > 5) {
-                            set_digit = 5;
-                        }
-
-                        /* Check and adjust all digits to meet time limits */
-                        if (time_setting.tens_hours == 2) {
-                            if (time_setting.hours > 3) {
-                                time_setting.hours = 0;
-                            }
-                        }
-                        
+/* Step the digit being set up one, wrapping within its range */
+static void set_digit_up(void) {
+    if (set_digit == 5) {
+        time_setting.tens_hours++;
+        if (time_setting.tens_hours > 2) {
+            time_setting.tens_hours = 0;
+        }
+    } else if (set_digit == 4) {
+        time_setting.hours++;
+        if (time_setting.tens_hours == 2) {
+            if (time_setting.hours > 3) {
+                time_setting.hours = 0;
+            }
+        } else {
+            if (time_setting.hours > 9) {
+                time_setting.hours = 0;
+            }
+        }
+    } else if (set_digit == 3) {
+        time_setting.tens_minutes++;
+        if (time_setting.tens_minutes > 5) {
+            time_setting.tens_minutes = 0;
+        }
+    } else if (set_digit == 2) {
+        time_setting.minutes++;
+        if (time_setting.minutes > 9) {
+            time_setting.minutes = 0;
+        }
+    } else if (set_digit == 1) {
+        time_setting.tens_seconds++;
+        if (time_setting.tens_seconds > 5) {
+            time_setting.tens_seconds = 0;
+        }
+    } else if (set_digit == 0) {
+        time_setting.seconds++;
+        if (time_setting.seconds > 9) {
+            time_setting.seconds = 0;
+        }
+    }
+}
 
-                    }
-                } else {
-                    if (!(pa & SW_NEXT)) {
-                        /* Set date mode, clock will display date/temp */
-                        nixie_mode = NIXIE_DATE_MODE;
-                    }
-                }
+/* Step the digit being set down one, wrapping within its range */
+static void set_digit_down(void) {
+    if (set_digit == 5) {
+        time_setting.tens_hours--;
+        if (time_setting.tens_hours > 2) {
+            time_setting.tens_hours = 2;
+        }
+    } else if (set_digit == 4) {
+        time_setting.hours--;
+        if (time_setting.tens_hours == 2) {
+            if (time_setting.hours > 3) {
+                time_setting.hours = 3;
+            }
+        } else {
+            if (time_setting.hours > 9) {
+                time_setting.hours = 9;
+            }
+        }
+    } else if (set_digit == 3) {
+        time_setting.tens_minutes--;
+        if (time_setting.tens_minutes > 5) {
+            time_setting.tens_minutes = 5;
+        }
+    } else if (set_digit == 2) {
+        time_setting.minutes--;
+        if (time_setting.minutes > 9) {
+            time_setting.minutes = 9;
+        }
+    } else if (set_digit == 1) {
+        time_setting.tens_seconds--;
+        if (time_setting.tens_seconds > 5) {
+            time_setting.tens_seconds = 5;
+        }
+    } else if (set_digit == 0) {
+        time_setting.seconds--;
+        if (time_setting.seconds > 9) {
+            time_setting.seconds = 9;
+        }
+    }
+}
 
-                break;
-            case SW_TUP:
-                if ((nixie_mode == NIXIE_SET_MODE) || (nixie_mode == NIXIE_SET_COUNT_MODE)) {
-                    if (!(pa & SW_TUP)){
-                        if (set_digit == 5) {
-                            time_setting.tens_hours++;
-                            if (time_setting.tens_hours > 2) {
-                                time_setting.tens_hours = 0;
-                            }
-                        } else if (set_digit == 4) {
-                            time_setting.hours++;
-                            if (time_setting.tens_hours == 2) {
-                                if (time_setting.hours > 3) {
-                                    time_setting.hours = 0;
-                                }
-                            } else {
-                                if (time_setting.hours > 9) {
-                                    time_setting.hours = 0;
-                                }
-                            }
-                        } else if (set_digit == 3) {
-                            time_setting.tens_minutes++;
-                            if (time_setting.tens_minutes > 5) {
-                                time_setting.tens_minutes = 0;
-                            }
-                        } else if (set_digit == 2) {
-                            time_setting.minutes++;
-                            if (time_setting.minutes > 9) {
-                                time_setting.minutes = 0;
-                            }
-                        } else if (set_digit == 1) {
-                            time_setting.tens_seconds++;
-                            if (time_setting.tens_seconds > 5) {
-                                time_setting.tens_seconds = 0;
-                            }
-                        } else if (set_digit == 0) {
-                            time_setting.seconds++;
-                            if (time_setting.seconds > 9) {
-                                time_setting.seconds = 0;
-                            }
-                        }
+/* One switch change from the MAX6818 */
+static void ui_event(sw_event_t *e) {
+    uint8_t temp = (e->pressed | e->released);
 
+    test = temp;
+    /* Anything happening stops auto-repeat */
+    ui_repeat = 0;
 
-                    }
-                } else {
-                    if ((pa & 0x0f) == 0x0b) {
-                        nixie_mode = NIXIE_WAVE_MODE;
-                        set_digit = 5;
-                    }
-                }
-                break;
-            case SW_TDOWN:
-                if ((nixie_mode == NIXIE_SET_MODE) || (nixie_mode == NIXIE_SET_COUNT_MODE)) {
-                    if (!(pa & SW_TDOWN)){
-                        if (set_digit == 5) {
-                            time_setting.tens_hours--;
-                            if (time_setting.tens_hours > 2) {
-                                time_setting.tens_hours = 2;
-                            }
-                        } else if (set_digit == 4) {
-                            time_setting.hours--;
-                            if (time_setting.tens_hours == 2) {
-                                if (time_setting.hours > 3) {
-                                    time_setting.hours = 3;
-                                }
-                            } else {
-                                if (time_setting.hours > 9) {
-                                    time_setting.hours = 9;
-                                }
-                            }
-                        } else if (set_digit == 3) {
-                            time_setting.tens_minutes--;
-                            if (time_setting.tens_minutes > 5) {
-                                time_setting.tens_minutes = 5;
-                            }
-                        } else if (set_digit == 2) {
-                            time_setting.minutes--;
-                            if (time_setting.minutes > 9) {
-                                time_setting.minutes = 9;
-                            }
-                        } else if (set_digit == 1) {
-                            time_setting.tens_seconds--;
-                            if (time_setting.tens_seconds > 5) {
-                                time_setting.tens_seconds = 5;
-                            }
-                        } else if (set_digit == 0) {
-                            time_setting.seconds--;
-                            if (time_setting.seconds > 9) {
-                                time_setting.seconds = 9;
-                            }
-                        }
+    if (pcnt_lktb[temp] != 1) {
+        return;
+    }
 
-                    }
+    if (temp == SW_SHDN) {
+        if (!(e->state & SW_SHDN)) {
+            hv = 0x01;
+        } else {
+            hv = 0x00;
+        }
+    } else if ((temp == SW_TSET) && ((e->state & 0x0f) == (~SW_TSET & 0x0f))) {
+        /* TSET held, set the time */
+        fsm_post(&display_fsm, NIXIE_SET_MODE);
+    } else if ((temp == SW_TSET) && ((e->state & 0x0f) == (~(SW_TSET | SW_NEXT) & 0x0f))) {
+        /* TSET held with NEXT, set a countdown */
+        fsm_post(&display_fsm, NIXIE_SET_COUNT_MODE);
+    } else {
+        fsm_event(&display_fsm, NIXIE_EV_SWITCH, e);
+    }
+}
 
-                } else {
-                    if ((pa & 0x0f) == 0x07) {
-                        nixie_mode = NIXIE_TIME_MODE;
-                        set_digit = 5;
-                    }
-                }
-                break;
-            case SW_SHDN:
-                if (!(pa & SW_SHDN)) {
-                    hv = 0x01;
-                } else {
-                    hv = 0x00;
-                }
-                break;
-            default:
-                break;
+/* Switch events from the PCINT0 ISR, plus auto-repeat of the held
+   up/down switch while setting */
+static void ui_task(void) {
+    sw_event_t e;
+
+    /* Mode changes are taken per event so the next one goes to the
+       right mode */
+    while (sw_get_event(&e)) {
+        ui_event(&e);
+        fsm_transition(&display_fsm);
+    }
+
+    if (ui_repeat) {
+        /* Leaving the set modes also stops it */
+        if (sw_state & ui_repeat) {
+            ui_repeat = 0;
+        } else if (!((tick_ms() - ui_repeat_tick) & 0x8000)) {
+            if (ui_repeat == SW_TUP) {
+                set_digit_up();
+            } else {
+                set_digit_down();
             }
+            ui_repeat_tick += UI_REPEAT_MS;
         }
-            
-        pa_store = pa;
-
-        /* EN back high (resets CH) */
-        _delay_us(1);
-        PORTC |= (1 << PC2);
     }
 }
-
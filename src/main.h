@@ -42,6 +42,7 @@
 
 //volatile uint8_t pps;
 
+/* Packed BCD (0x00-0x59 etc), the same as the DS3231 registers */
 typedef struct {
     volatile uint8_t seconds;
     volatile uint8_t minutes;
@@ -65,7 +66,7 @@ typedef struct {
 
 /* Function Prototypes: */
 void setup_hardware(void);
-void increment_time(void);
+void increment_time(uint8_t latched);
 
 /* USB stuff */
 void EVENT_USB_Device_Connect(void);
@@ -6,12 +6,98 @@
    NOTE: uart_init must be called before using this library.
 */
 
-#include <util/delay.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
 #include "mtk3339.h"
 #include "uart.h"
 #include "nmea.h"
 #include "main.h"
+#include "tick.h"
+#include "timebase.h"
+#include "spi.h"
+#include "sched.h"
 
+/* Engine states */
+#define PMTK_IDLE 0
+#define PMTK_WAIT_TX 1
+#define PMTK_WAIT_ACK 2
+
+typedef struct {
+    /* complete sentence including checksum and \r\n */
+    const char *cmd;
+    /* command number, matched against $PMTK001 */
+    uint16_t num;
+    /* 0 means no ack is expected */
+    uint16_t timeout_ms;
+    uint8_t retries;
+    pmtk_callback_t done;
+} pmtk_command_t;
+
+static pmtk_command_t pmtk_queue[PMTK_QUEUE_LEN];
+static uint8_t pmtk_head = 0;
+static uint8_t pmtk_count = 0;
+static uint8_t pmtk_state = PMTK_IDLE;
+static uint16_t pmtk_sent_at = 0;
+
+/* Autobaud. Rates are probed in this order, escalation aims for the
+   highest one that will verify. */
+#define MTK3339_NBAUD 4
+static const uint32_t mtk3339_bauds[MTK3339_NBAUD] PROGMEM = {
+    9600, 38400, 57600, 115200
+};
+static const char * const mtk3339_baud_cmds[MTK3339_NBAUD] = {
+    PMTK_SET_NMEA_BAUDRATE_9600,
+    PMTK_SET_NMEA_BAUDRATE_38400,
+    PMTK_SET_NMEA_BAUDRATE_57600,
+    PMTK_SET_NMEA_BAUDRATE_115200
+};
+
+/* rate currently being listened to */
+static uint8_t baud_idx = 0;
+/* rate we are trying to reach, lowered each time a switch fails */
+static uint8_t baud_target = MTK3339_NBAUD - 1;
+static uint16_t baud_start = 0;
+
+/* Output profiles */
+#define MTK3339_PROFILE_NONE 0xff
+/* "$PMTK314," + 19 fields + "*hh\r\n" */
+#define PMTK_CMD_MAX 56
+
+typedef struct {
+    /* fix interval */
+    uint16_t period_ms;
+    /* sentence output every n fixes, 0 for off */
+    uint8_t rmc;
+    uint8_t gsa;
+} mtk3339_profile_t;
+
+static const mtk3339_profile_t mtk3339_profiles[MTK3339_NPROFILES] PROGMEM = {
+    /* MTK3339_PROFILE_ACQUIRE */
+    {200, 1, 1},
+    /* MTK3339_PROFILE_STEADY */
+    {1000, 1, 5}
+};
+
+/* Commands are queued by pointer so they live here until sent */
+static char profile_output_cmd[PMTK_CMD_MAX];
+static char profile_rate_cmd[PMTK_CMD_MAX];
+static uint8_t profile_want = MTK3339_PROFILE_ACQUIRE;
+static uint16_t rate_start = 0;
+static uint16_t rate_bytes = 0;
+
+/* PPS edge / RMC association */
+/* PPS drives the_time (otherwise it is only timestamped) */
+static volatile uint8_t pps_drives_time = 0;
+static uint8_t rmc_seq_seen = 0;
+static uint8_t latency_rejects = 0;
+static gps_rmc_time_t pps_label;
+static uint8_t pps_label_seq = 0;
+static uint8_t pps_label_valid = 0;
+
+static void mtk3339_listen(uint8_t);
+static void mtk3339_autobaud(void);
 /* Prepare the correct pins and peripherals on the at90usb1287 to
    control the GPS. */
 void mtk3339_hw_init(void) {
@@ -20,78 +106,387 @@ void mtk3339_hw_init(void) {
     PORTE &= ~(1 << PE7);
     /* Rising edge interrupts */
     EICRB |= (1 << ISC71) | (1 << ISC70);
+
+    /* Always on so every edge gets timestamped, mtk3339_enable_int()
+       decides if it also ticks the clock */
+    EIMSK |= (1 << INT7);
 }
 
+/* Let the PPS edge drive the clock */
 void mtk3339_enable_int(void) {
-    /* Enable interrupt */
-    EIMSK |= (1 << INT7);
+    pps_drives_time = 1;
 }
 
 void mtk3339_disable_int(void) {
-    EIMSK &= ~(1 << INT7);
+    pps_drives_time = 0;
 }
 
-void mtk3339_init(void) {
-    /* RMC only output for now */
-    //mtk3339_send_command(PMTK_SET_NMEA_OUTPUT_RMC, 1);
-    mtk3339_send_command(PMTK_SET_NMEA_OUTPUT_RMC_GSA, 1);
+/* Tie the latest on-the-second RMC to the PPS edge it describes. The
+   MTK sends the RMC for an edge some time after it, so an RMC whose
+   '$' landed within a second after the latest edge labels that edge.
+   The measured latency has to agree with what we've seen before,
+   which keeps a missed edge from labelling the wrong second. */
+static void mtk3339_associate(void) {
+    uint32_t pps = 0;
+    uint8_t seq = 0;
+    int32_t d = 0;
+    int32_t err = 0;
 
-    /* Set higher baud rate so that we can get more packets per
-       second. Ignore ack! */
-    mtk3339_send_command(PMTK_SET_NMEA_BAUDRATE_57600, 0);
+    if (gps_rmc_seq == rmc_seq_seen) {
+        return;
+    }
+    rmc_seq_seen = gps_rmc_seq;
+
+    /* Only whole second fixes line up with an edge */
+    if (gps_time_ms != 0) {
+        return;
+    }
 
-    /* Allow baud change to 'settle' */
-    _delay_ms(100);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pps = mtk3339_pps_stamp;
+        seq = mtk3339_pps_seq;
+    }
+
+    d = (int32_t)(gps_rmc_stamp - pps);
+    if ((d < 0) || (d >= (int32_t)F_CPU)) {
+        /* No edge in the second before it */
+        return;
+    }
+
+    if (mtk3339_pps_latency) {
+        err = d - (int32_t)mtk3339_pps_latency;
+        if ((err > MTK3339_LATENCY_WINDOW) || (err < -MTK3339_LATENCY_WINDOW)) {
+            /* Doesn't fit, unless it keeps happening (new baud rate or
+               profile) */
+            if (++latency_rejects < 5) {
+                return;
+            }
+            mtk3339_pps_latency = d;
+        } else {
+            mtk3339_pps_latency += (err >> 3);
+        }
+    } else {
+        mtk3339_pps_latency = d;
+    }
+    latency_rejects = 0;
+
+    pps_label = gps_time;
+    pps_label_seq = seq;
+    pps_label_valid = 1;
+}
+
+/* UTC of the most recent PPS edge. Returns 0 if no RMC has been tied
+   to that edge (yet). Call with interrupts off so the edge can't move
+   underneath the caller. */
+uint8_t mtk3339_pps_time(gps_rmc_time_t *t) {
+    if (!pps_label_valid || (pps_label_seq != mtk3339_pps_seq)) {
+        return 0;
+    }
+
+    *t = pps_label;
+    return 1;
+}
+
+/* Start looking for the module. mtk3339_task() probes each baud
+   rate for a valid sentence, moves the module up to the fastest rate
+   that verifies and then queues the start up configuration. Nothing
+   here waits on the GPS. */
+void mtk3339_init(void) {
+    baud_target = MTK3339_NBAUD - 1;
+    while ((baud_target > 0) &&
+           (pgm_read_dword(&mtk3339_bauds[baud_target]) > MTK3339_MAX_BAUD)) {
+        baud_target--;
+    }
+    mtk3339_listen(0);
+    mtk3339_baud_state = MTK3339_BAUD_PROBE;
+}
+
+/* Restart the uart at one of the probe rates and start listening */
+static void mtk3339_listen(uint8_t idx) {
+    baud_idx = idx;
+    mtk3339_baud = pgm_read_dword(&mtk3339_bauds[idx]);
 
-    /* No ack after this! */
     uart_disable();
     uart_flush_buffer();
     nmea_flush();
-    uart_init(57600);
+    uart_init(mtk3339_baud);
 
-    mtk3339_send_command(PMTK_TEST, 1);
-    
-    mtk3339_send_command(PMTK_SET_NMEA_UPDATERATE_5HZ, 1);
+    /* Something to answer in case NMEA output is off */
+    uart_send_string(PMTK_TEST);
+    baud_start = tick_ms();
+}
+
+/* Module is talking to us at the best rate we can get, configure it */
+static void mtk3339_configure(void) {
+    mtk3339_baud_state = MTK3339_BAUD_LOCKED;
+
+    /* Output sentences and rate come from the profile, sent from
+       mtk3339_task() */
+    mtk3339_profile = MTK3339_PROFILE_NONE;
+}
+
+/* Wrap a command body ("PMTK220,1000") into a complete sentence with
+   checksum. Returns 1 if it doesn't fit in size bytes. */
+uint8_t mtk3339_build_command(char *buf, uint8_t size, const char *body) {
+    uint8_t i = 0;
+    uint8_t cksum = 0;
+
+    if ((strlen(body) + 7) > size) {
+        return 1;
+    }
+
+    buf[0] = '$';
+    for (i = 0; body[i] != 0; i++) {
+        buf[i + 1] = body[i];
+        cksum ^= body[i];
+    }
+    sprintf(buf + i + 1, "*%02X\r\n", cksum);
+
+    return 0;
+}
+
+/* Ask for an output profile (MTK3339_PROFILE_*). Cheap to call every
+   pass, commands only go out when the profile actually changes. */
+void mtk3339_set_profile(uint8_t profile) {
+    if (profile < MTK3339_NPROFILES) {
+        profile_want = profile;
+    }
+}
+
+/* Build and queue the commands for the wanted profile. Only called
+   with the queue empty, so both commands fit. */
+static void mtk3339_apply_profile(void) {
+    mtk3339_profile_t p;
+    char body[PMTK_CMD_MAX];
+    uint8_t err = 0;
+
+    memcpy_P(&p, &mtk3339_profiles[profile_want], sizeof(p));
+
+    /* GLL RMC VTG GGA GSA GSV, 11 reserved, ZDA, MCHN */
+    sprintf(body, "PMTK314,0,%u,0,0,%u,0,0,0,0,0,0,0,0,0,0,0,0,0,0", p.rmc, p.gsa);
+    err |= mtk3339_build_command(profile_output_cmd, sizeof(profile_output_cmd), body);
+    sprintf(body, "PMTK220,%u", p.period_ms);
+    err |= mtk3339_build_command(profile_rate_cmd, sizeof(profile_rate_cmd), body);
+    if (err) {
+        /* Can't be sent, don't keep trying every pass */
+        profile_want = mtk3339_profile;
+        return;
+    }
+
+    mtk3339_queue_command(profile_output_cmd, PMTK_ACK_TIMEOUT_MS, PMTK_RETRIES, 0);
+    mtk3339_queue_command(profile_rate_cmd, PMTK_ACK_TIMEOUT_MS, PMTK_RETRIES, 0);
+    mtk3339_profile = profile_want;
+}
+
+/* Autobaud state machine, a valid checksummed sentence of any kind
+   (including the ack to PMTK_TEST) counts as proof of the rate. */
+static void mtk3339_autobaud(void) {
+    uint8_t heard = (npackets != 0);
+
+    switch (mtk3339_baud_state) {
+    case MTK3339_BAUD_PROBE:
+        if (heard) {
+            if (baud_idx == baud_target) {
+                mtk3339_configure();
+            } else {
+                /* Ask for the target rate, the ack comes back at the
+                   new rate so don't wait for it */
+                uart_send_string(mtk3339_baud_cmds[baud_target]);
+                mtk3339_baud_state = MTK3339_BAUD_SWITCH;
+            }
+        } else if (tick_since(baud_start) >= MTK3339_PROBE_MS) {
+            /* Nothing here, try the next one (forever, the module may
+               simply not be powered yet) */
+            mtk3339_listen((baud_idx + 1) % MTK3339_NBAUD);
+        }
+        break;
+    case MTK3339_BAUD_SWITCH:
+        /* Switch once the command has left the shift register */
+        if (!uart_tx_busy) {
+            mtk3339_listen(baud_target);
+            mtk3339_baud_state = MTK3339_BAUD_VERIFY;
+        }
+        break;
+    case MTK3339_BAUD_VERIFY:
+        if (heard) {
+            mtk3339_configure();
+        } else if (tick_since(baud_start) >= MTK3339_PROBE_MS) {
+            /* Didn't take (or the rate doesn't work on this board).
+               The module may still hear us even if we can't hear it,
+               so ask it to come down a step from here. Out of steps,
+               go and find out where it ended up. */
+            if (baud_target > 0) {
+                baud_target--;
+                uart_send_string(mtk3339_baud_cmds[baud_target]);
+                mtk3339_baud_state = MTK3339_BAUD_SWITCH;
+            } else {
+                mtk3339_listen(0);
+                mtk3339_baud_state = MTK3339_BAUD_PROBE;
+            }
+        }
+        break;
+    default:
+        break;
+    }
 }
 
 void mtk3339_test(void) {
     mtk3339_send_command(PMTK_TEST, 1);
 }
 
-void mtk3339_set_output_rmc(void) {
-    mtk3339_send_command(PMTK_SET_NMEA_OUTPUT_RMC, 1);
+/* Send a command to GPS (non-blocking):
+   cmd: a complete command as a string (use #defines in mtk3339.h
+   ack: 1 for must ack, 0 for ignore ack
+   Returns 1 if the command queue is full. */
+uint8_t mtk3339_send_command(const char* cmd, uint8_t ack) {
+    if (ack) {
+        return mtk3339_queue_command(cmd, PMTK_ACK_TIMEOUT_MS, PMTK_RETRIES, 0);
+    }
+
+    return mtk3339_queue_command(cmd, 0, 0, 0);
 }
 
-void mtk3339_set_output_default(void) {
-    mtk3339_send_command(PMTK_SET_NMEA_OUTPUT_DEFAULT, 1);
+/* Queue a command for the engine:
+   cmd: complete command string, must stay valid until done
+   timeout_ms: how long to wait for the ack, 0 if none is expected
+   retries: number of resends after a timeout
+   done: completion callback or 0
+   Returns 1 if the queue is full. */
+uint8_t mtk3339_queue_command(const char *cmd, uint16_t timeout_ms,
+                              uint8_t retries, pmtk_callback_t done) {
+    pmtk_command_t *c;
+    uint8_t i = 0;
+
+    if (pmtk_count >= PMTK_QUEUE_LEN) {
+        return 1;
+    }
+
+    i = pmtk_head + pmtk_count;
+    if (i >= PMTK_QUEUE_LEN) {
+        i -= PMTK_QUEUE_LEN;
+    }
+    c = &pmtk_queue[i];
+
+    c->cmd = cmd;
+    /* "$PMTKnnn,..." */
+    c->num = atoi(cmd + 5);
+    c->timeout_ms = timeout_ms;
+    c->retries = retries;
+    c->done = done;
+    pmtk_count++;
+
+    return 0;
 }
 
-/* Send a command to GPS:
-   cmd: a complete command as a string (use #defines in mtk3339.h
-   ack: 1 for must ack, 0 for ignore ack */
-uint8_t mtk3339_send_command(char* cmd, uint8_t ack) {
-    pmtk_ack = 0;
-    pmtk_nack = 0;
+/* Anything queued or in flight? */
+uint8_t mtk3339_busy(void) {
+    return(pmtk_count != 0);
+}
 
-    /* send command */
-    uart_send_string(cmd);
-    if (ack) {
-        /* Loop while waiting for ack or nack */
-        while(!pmtk_ack){
-            uart_task();
-            if (pmtk_nack) {
+/* Retire the head of the queue */
+static void mtk3339_complete(uint8_t status) {
+    pmtk_command_t c = pmtk_queue[pmtk_head];
+
+    pmtk_head++;
+    if (pmtk_head >= PMTK_QUEUE_LEN) {
+        pmtk_head = 0;
+    }
+    pmtk_count--;
+    pmtk_state = PMTK_IDLE;
+
+    if (c.done) {
+        c.done(c.num, status);
+    }
+}
+
+/* Must be called frequently in main loop! Runs autobaud, then sends
+   queued commands one at a time and matches acks against them. */
+void mtk3339_task(void) {
+    pmtk_command_t *c;
+
+    if (mtk3339_baud_state != MTK3339_BAUD_LOCKED) {
+        mtk3339_autobaud();
+        return;
+    }
+
+    mtk3339_associate();
+
+    /* NMEA byte rate for the profile in use */
+    if (tick_since(rate_start) >= 1000) {
+        rate_start += 1000;
+        if (mtk3339_profile < MTK3339_NPROFILES) {
+            mtk3339_profile_rate[mtk3339_profile] = uart_rx_bytes - rate_bytes;
+        }
+        rate_bytes = uart_rx_bytes;
+    }
+
+    if (!pmtk_count) {
+        /* Profile buffers are only rewritten once the queue is empty */
+        if (profile_want != mtk3339_profile) {
+            mtk3339_apply_profile();
+        }
+        return;
+    }
+    c = &pmtk_queue[pmtk_head];
+
+    switch (pmtk_state) {
+    case PMTK_IDLE:
+        /* One command at a time, so it always fits in the TX buffer */
+        if (uart_tx_busy) {
+            return;
+        }
+        pmtk_ack = 0;
+        pmtk_nack = 0;
+        uart_send_string(c->cmd);
+        pmtk_sent_at = tick_ms();
+        pmtk_state = (c->timeout_ms ? PMTK_WAIT_ACK : PMTK_WAIT_TX);
+        break;
+    case PMTK_WAIT_TX:
+        if (!uart_tx_busy) {
+            mtk3339_complete(PMTK_STATUS_OK);
+        }
+        break;
+    case PMTK_WAIT_ACK:
+        if ((pmtk_ack || pmtk_nack) && (pmtk_ack_cmd == c->num)) {
+            if (pmtk_ack) {
+                pmtk_ack = 0;
+                mtk3339_complete(PMTK_STATUS_OK);
+            } else {
                 pmtk_nack = 0;
-                return 1;
+                pmtk_nacks++;
+                mtk3339_complete(PMTK_STATUS_NACK);
+            }
+        } else if (tick_since(pmtk_sent_at) >= c->timeout_ms) {
+            pmtk_timeouts++;
+            if (c->retries) {
+                c->retries--;
+                pmtk_state = PMTK_IDLE;
+            } else {
+                mtk3339_complete(PMTK_STATUS_TIMEOUT);
             }
         }
-        pmtk_ack = 0;
+        break;
+    default:
+        pmtk_state = PMTK_IDLE;
+        break;
     }
-    
-    return 0;
 }
 
 ISR(INT7_vect) {
-    increment_time();
-    PORTD ^= (1 << PD6);
+    uint8_t latched = 0;
+
+    mtk3339_pps_stamp = timebase_ticks();
+    /* Pre-rendered second up first, the bookkeeping can wait */
+    if (pps_drives_time) {
+        latched = spi_latch_armed();
+    }
+    mtk3339_pps_seq++;
+    sched_wake();
+
+    if (pps_drives_time) {
+        timebase_mark(mtk3339_pps_stamp, TIMEBASE_SRC_GPS);
+        increment_time(latched);
+        PORTD ^= (1 << PD6);
+    }
 }
 
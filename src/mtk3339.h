@@ -9,7 +9,29 @@
 #ifndef _MTK3339_H_
 #define _MTK3339_H_
 
+#include <stdint.h>
+#include "nmea.h"
+
 #define MTK3339_DEFAULT_BAUD 9600
+/* Fastest rate we try to run the module at */
+#define MTK3339_MAX_BAUD 115200
+/* How long to listen at each rate while probing */
+#define MTK3339_PROBE_MS 1500
+
+/* PMTK command engine */
+#define PMTK_QUEUE_LEN 6
+/* Wait this long for a $PMTK001 before resending */
+#define PMTK_ACK_TIMEOUT_MS 500
+#define PMTK_RETRIES 3
+
+/* Command completion status */
+#define PMTK_STATUS_OK 0
+#define PMTK_STATUS_NACK 1
+#define PMTK_STATUS_TIMEOUT 2
+
+/* Called from mtk3339_task() when a queued command finishes. cmd is
+   the PMTK command number, status one of PMTK_STATUS_*. */
+typedef void (*pmtk_callback_t)(uint16_t cmd, uint8_t status);
 
 #define PMTK_TEST "$PMTK000*32\r\n"
 
@@ -23,6 +45,7 @@
 #define PMTK_SET_NMEA_OUTPUT_DEFAULT "$PMTK314,-1*04\r\n"
 
 #define PMTK_SET_NMEA_BAUDRATE_DEFAULT "$PMTK251,0*28\r\n"
+#define PMTK_SET_NMEA_BAUDRATE_9600 "$PMTK251,9600*17\r\n"
 #define PMTK_SET_NMEA_BAUDRATE_38400 "$PMTK251,38400*27\r\n"
 #define PMTK_SET_NMEA_BAUDRATE_57600 "$PMTK251,57600*2C\r\n"
 #define PMTK_SET_NMEA_BAUDRATE_115200 "$PMTK251,115200*1F\r\n"
@@ -32,8 +55,48 @@ void mtk3339_hw_init(void);
 void mtk3339_enable_int(void);
 void mtk3339_disable_int(void);
 void mtk3339_test(void);
-void mtk3339_set_output_rmc(void);
-void mtk3339_set_output_default(void);
-uint8_t mtk3339_send_command(char* cmd, uint8_t ack);
+uint8_t mtk3339_send_command(const char* cmd, uint8_t ack);
+uint8_t mtk3339_queue_command(const char *cmd, uint16_t timeout_ms,
+                              uint8_t retries, pmtk_callback_t done);
+uint8_t mtk3339_busy(void);
+void mtk3339_set_profile(uint8_t profile);
+uint8_t mtk3339_pps_time(gps_rmc_time_t *t);
+uint8_t mtk3339_build_command(char *buf, uint8_t size, const char *body);
+void mtk3339_task(void);
+
+/* Output profiles. Acquisition runs fast with GSA on every fix so a
+   new 3D fix is noticed quickly, steady state drops to 1 Hz RMC with
+   GSA only every 5th fix (still enough to notice losing the fix). */
+#define MTK3339_PROFILE_ACQUIRE 0
+#define MTK3339_PROFILE_STEADY 1
+#define MTK3339_NPROFILES 2
+
+/* Largest change in PPS -> RMC latency accepted, in CPU ticks
+   (50 ms). Signed, it is compared against signed errors. */
+#define MTK3339_LATENCY_WINDOW ((int32_t)(F_CPU/20))
+
+/* Autobaud states */
+#define MTK3339_BAUD_PROBE 0
+#define MTK3339_BAUD_SWITCH 1
+#define MTK3339_BAUD_VERIFY 2
+#define MTK3339_BAUD_LOCKED 3
+
+/* Rate the uart is running at and where autobaud is */
+uint32_t mtk3339_baud;
+uint8_t mtk3339_baud_state;
+
+/* Profile in use and measured NMEA bytes per second for each */
+uint8_t mtk3339_profile;
+uint16_t mtk3339_profile_rate[MTK3339_NPROFILES];
+
+/* timebase_ticks() of the last PPS edge and a count of edges */
+volatile uint32_t mtk3339_pps_stamp;
+volatile uint8_t mtk3339_pps_seq;
+/* filtered PPS edge -> RMC '$' latency in CPU ticks */
+uint32_t mtk3339_pps_latency;
+
+/* Counters for the USB debug output */
+uint8_t pmtk_timeouts;
+uint8_t pmtk_nacks;
 
 #endif
@@ -0,0 +1,70 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Tube wiring and HV5522 frame building. The board wiring is
+   declared once below, the (byte, mask) lookup tables for every
+   cathode and the per tube blanking masks are built from it at
+   compile time.
+*/
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "nixie.h"
+
+/* Cathode (byte, mask) from the board wiring */
+#define NIXIE_CATH(t, d)                                        \
+    {NIXIE_PIN(t, d)/8, (uint8_t)(1 << (NIXIE_PIN(t, d)%8))}
+
+#define NIXIE_TUBE_CATHS(t)                                     \
+    {NIXIE_CATH(t, 0), NIXIE_CATH(t, 1), NIXIE_CATH(t, 2),      \
+     NIXIE_CATH(t, 3), NIXIE_CATH(t, 4), NIXIE_CATH(t, 5),      \
+     NIXIE_CATH(t, 6), NIXIE_CATH(t, 7), NIXIE_CATH(t, 8),      \
+     NIXIE_CATH(t, 9)}
+
+const nixie_cathode_t nixie_cathodes[NIXIE_TUBES][10] PROGMEM = {
+    NIXIE_TUBE_CATHS(NIXIE_SEC),
+    NIXIE_TUBE_CATHS(NIXIE_TENS_SEC),
+    NIXIE_TUBE_CATHS(NIXIE_MIN),
+    NIXIE_TUBE_CATHS(NIXIE_TENS_MIN),
+    NIXIE_TUBE_CATHS(NIXIE_HR),
+    NIXIE_TUBE_CATHS(NIXIE_TENS_HR)
+};
+
+/* Bits of frame byte b that belong to tube t */
+#define NIXIE_BIT_IN(t, d, b)                                   \
+    ((NIXIE_PIN(t, d)/8 == (b)) ? (1 << (NIXIE_PIN(t, d)%8)) : 0)
+
+#define NIXIE_BYTE_MASK(t, b)                                   \
+    (uint8_t)(NIXIE_BIT_IN(t, 0, b) | NIXIE_BIT_IN(t, 1, b) |   \
+              NIXIE_BIT_IN(t, 2, b) | NIXIE_BIT_IN(t, 3, b) |   \
+              NIXIE_BIT_IN(t, 4, b) | NIXIE_BIT_IN(t, 5, b) |   \
+              NIXIE_BIT_IN(t, 6, b) | NIXIE_BIT_IN(t, 7, b) |   \
+              NIXIE_BIT_IN(t, 8, b) | NIXIE_BIT_IN(t, 9, b))
+
+#define NIXIE_TUBE_MASKS(t)                                     \
+    {NIXIE_BYTE_MASK(t, 0), NIXIE_BYTE_MASK(t, 1),              \
+     NIXIE_BYTE_MASK(t, 2), NIXIE_BYTE_MASK(t, 3),              \
+     NIXIE_BYTE_MASK(t, 4), NIXIE_BYTE_MASK(t, 5),              \
+     NIXIE_BYTE_MASK(t, 6), NIXIE_BYTE_MASK(t, 7)}
+
+const uint8_t nixie_tube_masks[NIXIE_TUBES][NIXIE_FRAME_BYTES] PROGMEM = {
+    NIXIE_TUBE_MASKS(NIXIE_SEC),
+    NIXIE_TUBE_MASKS(NIXIE_TENS_SEC),
+    NIXIE_TUBE_MASKS(NIXIE_MIN),
+    NIXIE_TUBE_MASKS(NIXIE_TENS_MIN),
+    NIXIE_TUBE_MASKS(NIXIE_HR),
+    NIXIE_TUBE_MASKS(NIXIE_TENS_HR)
+};
+
+/* Turn every cathode of one tube off */
+void nixie_blank(volatile uint8_t *nd, uint8_t tube) {
+    const uint8_t *m = 0;
+    uint8_t i = 0;
+
+    if (tube < NIXIE_TUBES) {
+        m = nixie_tube_masks[tube];
+        for (i = 0; i < NIXIE_FRAME_BYTES; i++) {
+            nd[i] &= ~pgm_read_byte(&m[i]);
+        }
+    }
+}
@@ -0,0 +1,88 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Tube wiring and HV5522 frame building. The board wiring is
+   declared once below, the (byte, mask) lookup tables for every
+   cathode and the per tube blanking masks are built from it at
+   compile time.
+*/
+
+#ifndef _NIXIE_H_
+#define _NIXIE_H_
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/* Bytes shifted out to the two HV5522s per frame */
+#define NIXIE_FRAME_BYTES 8
+
+/* Tubes, right to left */
+#define NIXIE_SEC 0
+#define NIXIE_TENS_SEC 1
+#define NIXIE_MIN 2
+#define NIXIE_TENS_MIN 3
+#define NIXIE_HR 4
+#define NIXIE_TENS_HR 5
+#define NIXIE_TUBES 6
+
+/* Supported tube boards, select with -DNIXIE_BOARD=... */
+#define NIXIE_BOARD_REV_A 0
+#define NIXIE_BOARD_HR_FIRST 1
+
+#ifndef NIXIE_BOARD
+#define NIXIE_BOARD NIXIE_BOARD_REV_A
+#endif
+
+/* Board wiring. NIXIE_PIN(tube, digit) is the bit in the frame
+   (frame byte 0 bit 0 is the last bit shifted out) driving that
+   cathode. */
+#if NIXIE_BOARD == NIXIE_BOARD_REV_A
+/* Three tubes per HV5522, ten cathodes in digit order from the
+   tube's first output, outputs 30, 31 of each driver unused */
+#define NIXIE_PIN(tube, digit)                                  \
+    (((tube)/3)*32 + ((tube)%3)*10 + (digit))
+#elif NIXIE_BOARD == NIXIE_BOARD_HR_FIRST
+/* Same drivers with the chain mirrored: tens of hours on the first
+   outputs and the cathodes wired 9 down to 0 */
+#define NIXIE_PIN(tube, digit)                                  \
+    (((5 - (tube))/3)*32 + ((5 - (tube))%3)*10 + (9 - (digit)))
+#else
+#error "Unknown NIXIE_BOARD"
+#endif
+
+/* One cathode: frame byte and the bit within it */
+typedef struct {
+    uint8_t byte;
+    uint8_t mask;
+} nixie_cathode_t;
+
+extern const nixie_cathode_t nixie_cathodes[NIXIE_TUBES][10] PROGMEM;
+extern const uint8_t nixie_tube_masks[NIXIE_TUBES][NIXIE_FRAME_BYTES] PROGMEM;
+
+static inline void nixie_clear(volatile uint8_t *nd) {
+    uint8_t i = 0;
+
+    for (i = 0; i < NIXIE_FRAME_BYTES; i++) {
+        nd[i] = 0x00;
+    }
+}
+
+/* Light digit (0-9) on a tube, nothing for anything else */
+static inline void nixie_set(volatile uint8_t *nd, uint8_t tube, uint8_t digit) {
+    const nixie_cathode_t *c = 0;
+
+    if (digit < 10) {
+        c = &nixie_cathodes[tube][digit];
+        nd[pgm_read_byte(&c->byte)] |= pgm_read_byte(&c->mask);
+    }
+}
+
+/* Packed BCD pair on tube (ones) and tube + 1 (tens) */
+static inline void nixie_set_bcd(volatile uint8_t *nd, uint8_t tube, uint8_t bcd) {
+    nixie_set(nd, tube, bcd & 0x0f);
+    nixie_set(nd, tube + 1, bcd >> 4);
+}
+
+void nixie_blank(volatile uint8_t *nd, uint8_t tube);
+
+#endif
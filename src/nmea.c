@@ -2,170 +2,385 @@
    email: nicholas.nell@colorado.edu
 
    NMEA parser
+
+   Sentences are parsed in place, out of the uart RX slots, in one
+   pass that runs the checksum and finds the field ends. Fields a
+   registered sentence asks for are decoded into a staging area as
+   soon as their terminating ',' or '*' arrives, everything else only
+   goes through the checksum. Staged values are only published once
+   the '*hh' checksum has been verified.
 */
 
+#include <string.h>
+#include <avr/pgmspace.h>
 #include "uart.h"
 #include "nmea.h"
 
 #define UTC_ENTRY_LEN 10
+#define DATE_ENTRY_LEN 6
+
+/* Longest sentence allowed by NMEA 0183 ('$' through '\n') */
+#define NMEA_SENTENCE_MAX 82
+/* Longest sentence ID we look up ($PMTKnnn) */
+#define NMEA_ID_MAX 8
+
+/* Staged RMC flags */
+#define RMC_TIME_OK 0x01
+#define RMC_DATE_OK 0x02
+#define RMC_VALID 0x04
+
+/* Staged PMTK001 fields not seen (yet) */
+#define PMTK_CMD_NONE 0xffff
+#define PMTK_FLAG_NONE 0xff
+
+/* Sentence registry. Sentences are keyed on their 3-letter type
+   (RMC, GSA...) packed 5 bits per letter, the talker ID (GP, GN, GL
+   ...) is kept separately so every constellation shares one
+   handler. Proprietary sentences ($Pxxx) are keyed on the 3-letter
+   manufacturer code and the rest of the ID is left to the handler.
+
+   The table is a perfect hash: each entry lives in the slot given by
+   NMEA_HASH() so dispatch is one lookup. The hash is collision free
+   for RMC GSA GGA GSV GLL VTG ZDA GTO MTK; a collision between two
+   entries of NMEA_SENTENCES() fails the build.
+
+   fields has bit n set for each field n the handler wants to see,
+   the others are never handed to it. */
+#define NMEA_REGISTRY_SIZE 16
+#define NMEA_KEY(a, b, c) ((uint16_t)((((a) & 0x1f) << 10) | (((b) & 0x1f) << 5) | ((c) & 0x1f)))
+#define NMEA_HASH(a, b, c) (((a) ^ (b) ^ ((c) << 2)) & (NMEA_REGISTRY_SIZE - 1))
+#define NMEA_REGISTER(a, b, c, fields, field, publish)                  \
+    [NMEA_HASH(a, b, c)] = {NMEA_KEY(a, b, c), fields, field, publish},
+/* Slot bits of the entries: their sum only equals their OR if no
+   two share a slot */
+#define NMEA_SLOT_SUM(a, b, c, fields, field, publish) + (1UL << NMEA_HASH(a, b, c))
+#define NMEA_SLOT_OR(a, b, c, fields, field, publish) | (1UL << NMEA_HASH(a, b, c))
+#define NMEA_FIELD(n) (1U << (n))
+
+/* No registered sentence */
+#define NMEA_SLOT_NONE 0xff
+
+typedef struct {
+    /* NMEA_KEY() of the sentence type, 0 for an empty slot */
+    uint16_t key;
+    /* NMEA_FIELD() of each field field() is called with */
+    uint16_t fields;
+    /* called as each wanted field after the ID ends (may be 0) */
+    void (*field)(uint8_t idx, const char *buf, uint8_t len);
+    /* called once the checksum is good (may be 0) */
+    void (*publish)(void);
+} nmea_sentence_t;
+
+static void nmea_rmc_field(uint8_t, const char *, uint8_t);
+static void nmea_rmc_publish(void);
+static void nmea_gsa_field(uint8_t, const char *, uint8_t);
+static void nmea_gsa_publish(void);
+static void nmea_pgtop_publish(void);
+static void nmea_pmtk_field(uint8_t, const char *, uint8_t);
+static void nmea_pmtk_publish(void);
 
-uint8_t packet_buf[128];
-uint8_t packet_buf_pos = 0;
-uint8_t start_flag = 0;
-uint8_t stop_flag_r = 0;
-uint8_t packet_flag = 0;
+/* Registered sentences: type, wanted fields, field and publish
+   handlers */
+#define NMEA_SENTENCES(X)                                               \
+    /* UTC, status, date */                                             \
+    X('R', 'M', 'C', NMEA_FIELD(1) | NMEA_FIELD(2) | NMEA_FIELD(9),     \
+      nmea_rmc_field, nmea_rmc_publish)                                 \
+    /* fix type */                                                      \
+    X('G', 'S', 'A', NMEA_FIELD(2), nmea_gsa_field, nmea_gsa_publish)   \
+    /* $PGTOP */                                                        \
+    X('G', 'T', 'O', 0, 0, nmea_pgtop_publish)                          \
+    /* $PMTKnnn: command, flag */                                       \
+    X('M', 'T', 'K', NMEA_FIELD(1) | NMEA_FIELD(2),                     \
+      nmea_pmtk_field, nmea_pmtk_publish)
+
+_Static_assert((0 NMEA_SENTENCES(NMEA_SLOT_SUM)) == (0 NMEA_SENTENCES(NMEA_SLOT_OR)),
+               "two NMEA sentence types hash to the same registry slot");
+
+static const nmea_sentence_t nmea_registry[NMEA_REGISTRY_SIZE] PROGMEM = {
+    NMEA_SENTENCES(NMEA_REGISTER)
+};
+
+/* Current sentence: registry slot and the fields still wanted,
+   shifted down so bit 0 is the field being parsed */
+static uint8_t sentence_slot = NMEA_SLOT_NONE;
+static uint16_t sentence_fields = 0;
+static void (*sentence_field)(uint8_t, const char *, uint8_t);
+static uint32_t sentence_stamp = 0;
+static char sentence_talker[2];
+/* Numeric part of a proprietary ID ($PMTK001 -> 1) */
+static uint16_t sentence_sub = 0;
+
+/* Staging area, published on a good checksum */
+static gps_rmc_time_t rmc_time;
+static uint16_t rmc_ms = 0;
+static gps_rmc_date_t rmc_date;
+static char rmc_time_s[UTC_ENTRY_LEN];
+static uint8_t rmc_flags = 0;
+static uint8_t gsa_fix = 0;
+static uint16_t pmtk_cmd = PMTK_CMD_NONE;
+static uint8_t pmtk_flag = PMTK_FLAG_NONE;
+
+/* Two ASCII digits to an integer */
+static inline uint8_t nmea_dec2(const char *p) {
+    return((p[0] - '0')*10 + (p[1] - '0'));
+}
+
+/* One ASCII hex digit to its value, 0xff if it is not hex */
+static inline uint8_t nmea_hex(uint8_t c) {
+    if ((c >= '0') && (c <= '9')) {
+        return(c - '0');
+    } else if ((c >= 'A') && (c <= 'F')) {
+        return(c - 'A' + 10);
+    } else if ((c >= 'a') && (c <= 'f')) {
+        return(c - 'a' + 10);
+    }
+
+    return 0xff;
+}
 
 void nmea_flush(void) {
     pgtop = 0;
     gprmc = 0;
     gpgsa = 0;
     npackets = 0;
+    nmea_errors = 0;
     pmtk_ack = 0;
     pmtk_nack = 0;
-    packet_buf_pos = 0;
-    start_flag = 0;
-    stop_flag_r = 0;
-    packet_flag = 0;
     gps_fix = 0;
 }
 
-void nmea_parse(void) {
-    uint8_t count = 0;
+/* Look up the sentence ID (field 0, without the '$') in the
+   registry */
+static void nmea_identify(const char *id, uint8_t len) {
     uint8_t i = 0;
-    uint8_t j = 0;
-    uint8_t rx_byte = 0;
-    uint8_t utc_place = 0;
-
-    count = RingBuffer_GetCount(&uart_buf);
-
-    if (!start_flag) {
-        /* Look for start flag. If there is other junk in the buffer
-           before a '$' this will ignore it... */
-        for (i = 0; i < count; i++) {
-            rx_byte = RingBuffer_Remove(&uart_buf);
-            if (rx_byte == '$') {
-                packet_buf[0] = rx_byte;
-                packet_buf_pos++;
-                start_flag = 1;
+    uint8_t t = 0;
+    uint16_t key = 0;
+    const char *type = 0;
+
+    sentence_slot = NMEA_SLOT_NONE;
+    sentence_fields = 0;
+    sentence_sub = 0;
+
+    if ((len < 4) || (len > NMEA_ID_MAX)) {
+        return;
+    }
+
+    if (id[0] == 'P') {
+        /* Proprietary: P + manufacturer + whatever they like */
+        sentence_talker[0] = 'P';
+        sentence_talker[1] = 0;
+        type = &id[1];
+        for (i = 4; i < len; i++) {
+            t = id[i] - '0';
+            if (t > 9) {
                 break;
             }
+            sentence_sub = sentence_sub*10 + t;
         }
+    } else if (len == 5) {
+        sentence_talker[0] = id[0];
+        sentence_talker[1] = id[1];
+        type = &id[2];
+    } else {
+        return;
     }
 
-    if (!stop_flag_r && start_flag) {
-        count = RingBuffer_GetCount(&uart_buf);
-        for (i = 0; i < count; i++) {
-            rx_byte = RingBuffer_Remove(&uart_buf);
-            if (rx_byte == '\r') {
-                stop_flag_r = 1;
-                packet_buf[packet_buf_pos] = rx_byte;
-                packet_buf_pos++;
-                break;
-            } else {
-                packet_buf[packet_buf_pos] = rx_byte;
-                packet_buf_pos++;
-            }
+    key = NMEA_KEY(type[0], type[1], type[2]);
+    i = NMEA_HASH(type[0], type[1], type[2]);
+    if (pgm_read_word(&nmea_registry[i].key) == key) {
+        sentence_slot = i;
+        sentence_field = (void (*)(uint8_t, const char *, uint8_t))
+            pgm_read_word(&nmea_registry[i].field);
+        if (sentence_field) {
+            /* field 0 is the ID itself */
+            sentence_fields = pgm_read_word(&nmea_registry[i].fields) >> 1;
         }
     }
+}
+
+/* Parse a complete sentence ('$' through "*hh\r\n") in place. stamp
+   is the timebase_ticks() of its '$'. */
+void nmea_parse_sentence(const uint8_t *buf, uint8_t len, uint32_t stamp) {
+    const uint8_t *p = buf + 1;
+    const uint8_t *end = buf + len;
+    const uint8_t *field = p;
+    void (*publish)(void) = 0;
+    uint8_t cksum = 0;
+    uint8_t idx = 1;
+    uint8_t c = 0;
+    uint8_t hi = 0;
+    uint8_t lo = 0;
+
+    if ((len == 0) || (buf[0] != '$')) {
+        return;
+    }
+    if (len > NMEA_SENTENCE_MAX) {
+        nmea_errors++;
+        return;
+    }
 
-    if (!packet_flag && start_flag && stop_flag_r) {
-        count = RingBuffer_GetCount(&uart_buf);
-        if (count > 0) {
-            rx_byte = RingBuffer_Remove(&uart_buf);
-            if (rx_byte != '\n') {
-                /* what?! */
-            } else {
-                packet_buf[packet_buf_pos] = rx_byte;
-                packet_buf_pos++;
-                packet_flag = 1;
-            }                
+    /* Fresh staging area */
+    sentence_stamp = stamp;
+    rmc_flags = 0;
+    gsa_fix = 0;
+    pmtk_cmd = PMTK_CMD_NONE;
+    pmtk_flag = PMTK_FLAG_NONE;
+
+    /* Sentence ID */
+    while ((p < end) && (*p != ',') && (*p != '*')) {
+        cksum ^= *p++;
+    }
+    nmea_identify((const char *)field, p - field);
+
+    /* Fields the handler wants: split and hand them over */
+    while (sentence_fields && (p < end) && (*p != '*')) {
+        cksum ^= *p++;
+        field = p;
+        while ((p < end) && (*p != ',') && (*p != '*')) {
+            cksum ^= *p++;
+        }
+        if (sentence_fields & 0x01) {
+            sentence_field(idx, (const char *)field, p - field);
         }
+        sentence_fields >>= 1;
+        idx++;
     }
 
-    if (packet_flag) {
-        /* parse packet... */
-        if (strncmp((char*)packet_buf, "$PGTOP", 6) == 0) {
-            pgtop++;
-            /* add external antenna flag later */
-        } else if (strncmp((char*)packet_buf, "$GPGSA", 6) == 0) { 
-            i = 5;
-            while(packet_buf[i++] != ',');
-            /* Mode */
-
-            while(packet_buf[i++] != ',');
-            /* Fix status -- PPS line only runs on 3D fix */
-            if ((char)packet_buf[i] == '3') {
-                gps_fix = 1;
-            } else {
-                gps_fix = 0;
-            }
-            
-            gpgsa++;
-        } else if (strncmp((char*)packet_buf, "$GPRMC", 6) == 0) {
-            i = 5;
-            while(packet_buf[i++] != ',');
-            /* UTC */
-            utc_place = i;
-            while(packet_buf[i++] != ',');
-            /* packet valid/invalid */
-            if ((char)packet_buf[i] == 'A') {
-                //gps_fix = 1;
-                if ((i - utc_place) == (UTC_ENTRY_LEN + 1)) {
-                    gps_time.hours = (packet_buf[utc_place] - '0')*10 + (packet_buf[utc_place + 1] - '0');
-                    gps_time.minutes = (packet_buf[utc_place + 2] - '0')*10 + (packet_buf[utc_place + 3] - '0');
-                    gps_time.seconds = (packet_buf[utc_place + 4] - '0')*10 + (packet_buf[utc_place + 5] - '0');
-                    memset(gps_time_s, 0x00, sizeof(gps_time_s));
-                    for (j = 0; j < UTC_ENTRY_LEN; j++) {
-                        gps_time_s[j] = (char)packet_buf[utc_place + j];
-                    }
-                }
-                while(packet_buf[i++] != ',');
-                /* Latitude */
-                while(packet_buf[i++] != ',');
-                /* N/S */
-                while(packet_buf[i++] != ',');
-                /* Longitude */
-                while(packet_buf[i++] != ',');
-                /* E/W */
-                while(packet_buf[i++] != ',');
-                /* ground speed */
-                while(packet_buf[i++] != ',');
-                /* ground heading */
-                while(packet_buf[i++] != ',');
-                /* Date */
-                j = i;
-                while(packet_buf[j++] != ',');
-                if ((j - i) == 7) {
-                    gps_date.day = (packet_buf[i] - '0')*10 + (packet_buf[i + 1] - '0');
-                    gps_date.month = (packet_buf[i + 2] - '0')*10 + (packet_buf[i + 3] - '0');
-                    gps_date.year = (packet_buf[i + 4] - '0')*10 + (packet_buf[i + 5] - '0');
-                }
-            } else {
-                //gps_fix = 0;
-            }
-            gprmc++;
-        } else if (strncmp((char*)packet_buf, "$PMTK001", 8) == 0) {
-            i = 7;
-            while(packet_buf[i++] != ',');
-            while(packet_buf[i++] != ',');
-            /* Shows a successful ack */
-            if ((char)packet_buf[i] == '3') {
-                pmtk_ack = 1;
-            } else {
-                pmtk_nack = 1;
-            }
-            //pmtk_ack = 1;
+    /* The rest only goes through the checksum */
+    while ((p < end) && ((c = *p) != '*')) {
+        cksum ^= c;
+        p++;
+    }
+
+    /* MTK always sends a checksum, anything without one is junk */
+    if ((end - p) < 3) {
+        nmea_errors++;
+        return;
+    }
+    hi = nmea_hex(p[1]);
+    lo = nmea_hex(p[2]);
+    if ((hi > 0x0f) || (lo > 0x0f) || (((hi << 4) | lo) != cksum)) {
+        nmea_errors++;
+        return;
+    }
+
+    /* Checksum matched, make the staged values visible */
+    if (sentence_slot != NMEA_SLOT_NONE) {
+        publish = (void (*)(void))pgm_read_word(&nmea_registry[sentence_slot].publish);
+        if (publish) {
+            publish();
+        }
+    }
+
+    npackets++;
+}
 
+static void nmea_rmc_field(uint8_t idx, const char *buf, uint8_t len) {
+    if (idx == 1) {
+        /* UTC */
+        if (len == UTC_ENTRY_LEN) {
+            rmc_time.hours = nmea_dec2(&buf[0]);
+            rmc_time.minutes = nmea_dec2(&buf[2]);
+            rmc_time.seconds = nmea_dec2(&buf[4]);
+            rmc_ms = nmea_dec2(&buf[7])*10 + (buf[9] - '0');
+            memcpy(rmc_time_s, buf, UTC_ENTRY_LEN);
+            rmc_flags |= RMC_TIME_OK;
+        }
+    } else if (idx == 2) {
+        /* packet valid/invalid */
+        if ((len == 1) && (buf[0] == 'A')) {
+            rmc_flags |= RMC_VALID;
+        }
+    } else if (idx == 9) {
+        /* Date */
+        if (len == DATE_ENTRY_LEN) {
+            rmc_date.day = nmea_dec2(&buf[0]);
+            rmc_date.month = nmea_dec2(&buf[2]);
+            rmc_date.year = nmea_dec2(&buf[4]);
+            rmc_flags |= RMC_DATE_OK;
         }
+    }
+}
+
+static void nmea_rmc_publish(void) {
+    if (rmc_flags & RMC_VALID) {
+        if (rmc_flags & RMC_TIME_OK) {
+            gps_time = rmc_time;
+            gps_time_ms = rmc_ms;
+            gps_rmc_stamp = sentence_stamp;
+            gps_rmc_seq++;
+            memset(gps_time_s, 0x00, sizeof(gps_time_s));
+            memcpy(gps_time_s, rmc_time_s, UTC_ENTRY_LEN);
+        }
+        if (rmc_flags & RMC_DATE_OK) {
+            gps_date = rmc_date;
+        }
+    }
+    gps_talker[0] = sentence_talker[0];
+    gps_talker[1] = sentence_talker[1];
+    gprmc++;
+}
+
+static void nmea_gsa_field(uint8_t idx, const char *buf, uint8_t len) {
+    if (idx == 2) {
+        /* Fix status -- PPS line only runs on 3D fix */
+        gsa_fix = ((len == 1) && (buf[0] == '3'));
+    }
+}
+
+static void nmea_gsa_publish(void) {
+    gps_fix = gsa_fix;
+    gpgsa++;
+}
+
+static void nmea_pgtop_publish(void) {
+    pgtop++;
+    /* add external antenna flag later */
+}
+
+static void nmea_pmtk_field(uint8_t idx, const char *buf, uint8_t len) {
+    uint8_t i = 0;
+    uint8_t t = 0;
+    uint16_t cmd = 0;
 
+    /* $PMTK001,<cmd>,<flag> */
+    if (sentence_sub != 1) {
+        return;
+    }
 
-        npackets++;
+    if (idx == 1) {
+        /* 1-4 digits, anything else leaves it unseen */
+        if ((len == 0) || (len > 4)) {
+            return;
+        }
+        for (i = 0; i < len; i++) {
+            t = buf[i] - '0';
+            if (t > 9) {
+                return;
+            }
+            cmd = cmd*10 + t;
+        }
+        pmtk_cmd = cmd;
+    } else if (idx == 2) {
+        if ((len == 1) && (buf[0] >= '0') && (buf[0] <= '3')) {
+            pmtk_flag = buf[0] - '0';
+        }
+    }
+}
 
-        start_flag = 0;
-        stop_flag_r = 0;
-        packet_flag = 0;
-        packet_buf_pos = 0;
-        
+static void nmea_pmtk_publish(void) {
+    /* Both fields have to be there, a short $PMTK001 is no ack */
+    if ((sentence_sub != 1) || (pmtk_cmd == PMTK_CMD_NONE) ||
+        (pmtk_flag == PMTK_FLAG_NONE)) {
+        return;
     }
 
+    pmtk_ack_cmd = pmtk_cmd;
+    pmtk_ack_flag = pmtk_flag;
+    /* Shows a successful ack */
+    if (pmtk_flag == PMTK_ACK_OK) {
+        pmtk_ack = 1;
+    } else {
+        pmtk_nack = 1;
+    }
 }
@@ -20,17 +20,35 @@ typedef struct {
 } gps_rmc_date_t;
 
 uint8_t pgtop;
+/* PMTK001 ack flags */
+#define PMTK_ACK_INVALID 0
+#define PMTK_ACK_UNSUPPORTED 1
+#define PMTK_ACK_FAILED 2
+#define PMTK_ACK_OK 3
+
 uint8_t pmtk_ack;
 uint8_t pmtk_nack;
+/* command number and flag of the last $PMTK001 */
+uint16_t pmtk_ack_cmd;
+uint8_t pmtk_ack_flag;
 uint8_t npackets;
+/* sentences dropped for bad checksum/framing */
+uint8_t nmea_errors;
 uint8_t gprmc;
 uint8_t gpgsa;
 uint8_t gps_fix;
 gps_rmc_time_t gps_time;
 gps_rmc_date_t gps_date;
+/* milliseconds part of the last RMC UTC (non-zero above 1 Hz) */
+uint16_t gps_time_ms;
+/* timebase_ticks() at the '$' of the last RMC and a count of them */
+uint32_t gps_rmc_stamp;
+uint8_t gps_rmc_seq;
 char gps_time_s[20];
+/* talker ID of the last RMC (GP, GN, GL...) */
+char gps_talker[3];
 
-void nmea_parse(void);
+void nmea_parse_sentence(const uint8_t *buf, uint8_t len, uint32_t stamp);
 void nmea_flush(void);
 
 #endif
@@ -0,0 +1,114 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Cooperative scheduler run off the 1 kHz tick. Tasks come from a
+   PROGMEM table and must return quickly, nothing in the main loop
+   blocks.
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <string.h>
+#include "sched.h"
+#include "tick.h"
+#include "timebase.h"
+
+/* Duty cycle window */
+static uint32_t window_start = 0;
+static uint32_t window_sleep = 0;
+
+/* Clear the statistics and make every task due now */
+void sched_init(sched_stat_t *stats, uint8_t n) {
+    uint16_t now = tick_ms();
+    uint8_t i = 0;
+
+    memset(stats, 0x00, n*sizeof(sched_stat_t));
+    sched_duty = 1000;
+    window_start = timebase_ticks();
+    window_sleep = 0;
+    for (i = 0; i < n; i++) {
+        stats[i].due = now;
+    }
+}
+
+/* One pass over the table, runs everything that is due */
+void sched_run(const sched_task_t *tasks, sched_stat_t *stats, uint8_t n) {
+    void (*run)(void) = 0;
+    uint16_t period = 0;
+    uint16_t now = 0;
+    uint16_t lag = 0;
+    uint32_t t = 0;
+    uint8_t i = 0;
+
+    /* Anything an ISR queues from here on gets another pass */
+    sched_pending = 0;
+
+    for (i = 0; i < n; i++) {
+        run = (void (*)(void))pgm_read_word(&tasks[i].run);
+        period = pgm_read_word(&tasks[i].period);
+        now = tick_ms();
+
+        if (period) {
+            lag = now - stats[i].due;
+            /* Not due yet (wrap safe) */
+            if (lag & 0x8000) {
+                continue;
+            }
+            if (lag > pgm_read_word(&tasks[i].deadline)) {
+                stats[i].late++;
+            }
+            /* Keep the phase, but don't try to catch up on missed
+               runs */
+            stats[i].due += period;
+            if (lag >= period) {
+                stats[i].due = now + period;
+            }
+        }
+
+        t = timebase_ticks();
+        run();
+        t = timebase_ticks() - t;
+
+        stats[i].runs++;
+        if (t > stats[i].worst) {
+            stats[i].worst = t;
+        }
+    }
+}
+
+/* Idle until the next interrupt, at most one tick away. Every task
+   is fed by an ISR (UART, TWI, PPS, switches, USB, the tick itself),
+   so nothing waits longer than a millisecond. Idle is the deepest
+   mode that keeps clk_IO, and with it the timebase, the tick, the
+   UART and SPI, running.
+
+   sched_pending is checked with interrupts off. The instruction after
+   sei() always runs before any interrupt, so a wake up can't slip in
+   between the check and the SLEEP. */
+void sched_sleep(void) {
+    uint32_t t = timebase_ticks();
+    uint32_t elapsed = 0;
+
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    cli();
+    if (!sched_pending) {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    /* Else work came in during the pass, go round again */
+    sei();
+
+    window_sleep += timebase_ticks() - t;
+
+    elapsed = timebase_ticks() - window_start;
+    if (elapsed >= F_CPU) {
+        window_sleep /= (elapsed/1000);
+        sched_duty = (window_sleep < 1000) ? (1000 - window_sleep) : 0;
+        window_start += elapsed;
+        window_sleep = 0;
+    }
+}
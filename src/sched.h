@@ -0,0 +1,51 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Cooperative scheduler run off the 1 kHz tick. Tasks come from a
+   PROGMEM table and must return quickly, nothing in the main loop
+   blocks.
+*/
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/* Task table entry (PROGMEM) */
+typedef struct {
+    void (*run)(void);
+    /* Milliseconds between runs, 0 runs on every pass */
+    uint16_t period;
+    /* A run starting more than this many ms after it was due counts
+       as late */
+    uint16_t deadline;
+} sched_task_t;
+
+/* Per task statistics (RAM), one per table entry */
+typedef struct {
+    uint32_t runs;
+    uint16_t late;
+    /* Longest run in CPU (timebase) ticks */
+    uint32_t worst;
+    /* Tick the next run is due */
+    uint16_t due;
+} sched_stat_t;
+
+/* Busy fraction of the last second, per mille */
+uint16_t sched_duty;
+
+/* Set by the ISRs that hand the main loop work, cleared at the start
+   of each pass. sched_sleep() won't sleep on work that came in while
+   the pass was running. */
+volatile uint8_t sched_pending;
+
+static inline void sched_wake(void) {
+    sched_pending = 1;
+}
+
+void sched_init(sched_stat_t *stats, uint8_t n);
+void sched_run(const sched_task_t *tasks, sched_stat_t *stats, uint8_t n);
+void sched_sleep(void);
+
+#endif
@@ -5,8 +5,20 @@
 */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "spi.h"
 
+/* Frame being shifted out (last byte first) and the one queued
+   behind it */
+static uint8_t spi_frame[SPI_FRAME_BYTES];
+static uint8_t spi_next[SPI_FRAME_BYTES];
+static volatile uint8_t spi_pos = 0;
+static volatile uint8_t spi_pending = 0;
+/* Latch each frame when it is through, or leave it for spi_latch() */
+static volatile uint8_t spi_latch_cur = 0;
+static volatile uint8_t spi_latch_next = 0;
+
 void spi_init(void) {
     /* SCK and MOSI set as outputs */
     DDRB |= (1 << PB1) | (1 << PB2);
@@ -18,11 +30,83 @@ void spi_init(void) {
     //SPCR |= (1 << SPE) | (1 << MSTR) | (1 << SPR0) | (1 << CPHA);
     /* 4 MHz */
     SPCR |= (1 << SPE) | (1 << MSTR) | (1 << CPHA);
+
+    spi_frame_done = 1;
+    spi_frame_loaded = 0;
+    spi_frame_armed = 0;
 }
 
-/* Transmit and block until done */
+/* Transmit and block until done, only with the frame engine idle */
 void spi_master_tx(uint8_t payload) {
     SPDR = payload;
     while(!(SPSR & (1 << SPIF)));
 }
 
+/* Copy frame and start it, or queue it behind the one in flight. A
+   queued frame replaces anything already queued. */
+static void spi_frame_start(const volatile uint8_t *frame, uint8_t latch) {
+    uint8_t i = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        /* Whatever was loaded is on its way out */
+        spi_frame_armed = 0;
+        if (spi_frame_done) {
+            for (i = 0; i < SPI_FRAME_BYTES; i++) {
+                spi_frame[i] = frame[i];
+            }
+            spi_latch_cur = latch;
+            spi_frame_done = 0;
+            spi_frame_loaded = 0;
+            spi_pos = SPI_FRAME_BYTES - 1;
+            SPCR |= (1 << SPIE);
+            /* 10s hours first, seconds last */
+            SPDR = spi_frame[spi_pos];
+        } else {
+            for (i = 0; i < SPI_FRAME_BYTES; i++) {
+                spi_next[i] = frame[i];
+            }
+            spi_latch_next = latch;
+            spi_pending = 1;
+        }
+    }
+}
+
+/* Shift frame out in the background, the HV5522s latch it when the
+   last byte is through. Safe from ISRs. */
+void spi_frame_tx(const volatile uint8_t *frame) {
+    spi_frame_start(frame, 1);
+}
+
+/* Shift frame out in the background without latching it, the tubes
+   keep showing the old one until spi_latch() */
+void spi_frame_load(const volatile uint8_t *frame) {
+    spi_frame_start(frame, 0);
+}
+
+ISR(SPI_STC_vect) {
+    uint8_t i = 0;
+
+    if (spi_pos) {
+        spi_pos--;
+        SPDR = spi_frame[spi_pos];
+        return;
+    }
+
+    if (spi_latch_cur) {
+        spi_latch();
+    }
+
+    if (spi_pending) {
+        for (i = 0; i < SPI_FRAME_BYTES; i++) {
+            spi_frame[i] = spi_next[i];
+        }
+        spi_latch_cur = spi_latch_next;
+        spi_pending = 0;
+        spi_pos = SPI_FRAME_BYTES - 1;
+        SPDR = spi_frame[spi_pos];
+    } else {
+        SPCR &= ~(1 << SPIE);
+        spi_frame_loaded = !spi_latch_cur;
+        spi_frame_done = 1;
+    }
+}
@@ -8,9 +8,42 @@
 #define _SPI_H_
 
 #include <stdint.h>
+#include <avr/io.h>
+#include <util/delay.h>
+
+/* One frame for the two HV5522s */
+#define SPI_FRAME_BYTES 8
+
+/* Set once the last frame has been shifted out and latched */
+volatile uint8_t spi_frame_done;
+/* Set once a spi_frame_load() frame sits unlatched in the HV5522
+   shift registers, cleared by anything else touching them */
+volatile uint8_t spi_frame_loaded;
+/* Set by the display code when the frame it loaded is the next
+   second, cleared when another frame replaces it */
+volatile uint8_t spi_frame_armed;
 
 void spi_init(void);
 void spi_master_tx(uint8_t payload);
+void spi_frame_tx(const volatile uint8_t *frame);
+void spi_frame_load(const volatile uint8_t *frame);
 
-#endif
+/* Move the shift registers to the HV5522 outputs */
+static inline void spi_latch(void) {
+    PORTC |= (1 << PC0);
+    _delay_us(1);
+    PORTC &= ~(1 << PC0);
+    spi_frame_loaded = 0;
+}
 
+/* First thing in the PPS ISRs: put the armed frame up if it is all
+   the way in. Returns 1 if it was latched. */
+static inline uint8_t spi_latch_armed(void) {
+    if (spi_frame_armed && spi_frame_loaded) {
+        spi_latch();
+        return 1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,98 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   MAX6818 switch debouncer. The change interrupt only samples the
+   switches and queues an event, everything else happens in the main
+   loop.
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include "sw.h"
+#include "tick.h"
+#include "sched.h"
+
+/* Single producer (PCINT0 ISR), single consumer (main loop) ring.
+   Each index is only written by one side and is a single byte, so
+   no locking is needed. */
+static sw_event_t sw_queue[SW_QUEUE];
+static volatile uint8_t sw_head = 0;
+static volatile uint8_t sw_tail = 0;
+
+/* Switches before the last change */
+static uint8_t sw_last = SW_MASK;
+
+void sw_init(void) {
+    /* MAX6818 EN */
+    DDRC |= (1 << PC2);
+
+    PORTC |= (1 << PC2);
+    _delay_us(1);
+    PORTC &= ~(1 << PC2);
+    _delay_us(1);
+    PORTC |= (1 << PC2);
+
+    /* Set port A as input */
+    DDRA = 0x00;
+    sw_state = (PINA & SW_MASK);
+    sw_last = sw_state;
+    sw_overflows = 0;
+    /* Set pcint5 as input */
+    DDRB &= ~(1 << PB5);
+
+    PCICR |= (1 << PCIE0);
+    /* Only using max6818 interrupt for now */
+    PCMSK0 |= (1 << PCINT5);
+}
+
+/* Next event, returns 0 if there is none */
+uint8_t sw_get_event(sw_event_t *e) {
+    uint8_t t = sw_tail;
+
+    if (t == sw_head) {
+        return 0;
+    }
+    *e = sw_queue[t];
+    sw_tail = (t + 1) & (SW_QUEUE - 1);
+
+    return 1;
+}
+
+/* MAX6818 CH went low */
+ISR(PCINT0_vect) {
+    uint8_t h = sw_head;
+    uint8_t n = (h + 1) & (SW_QUEUE - 1);
+    uint8_t s = 0;
+    uint8_t c = 0;
+
+    if (!(PINB & (1 << PB5))) {
+        /* EN on max6818, outputs need a moment to drive. This settle
+           has to stay in the ISR: CH stays low until EN goes back
+           high, so deferring the sample to the main loop would leave
+           PCINT5 stuck and miss any change made in the meantime.
+           It's 16 cycles. */
+        PORTC &= ~(1 << PC2);
+        _delay_us(1);
+        s = (PINA & SW_MASK);
+        /* EN back high (resets CH) */
+        PORTC |= (1 << PC2);
+
+        c = s ^ sw_last;
+        sw_last = s;
+        sw_state = s;
+
+        if (c) {
+            if (n == sw_tail) {
+                sw_overflows++;
+            } else {
+                sw_queue[h].tick = tick_count;
+                sw_queue[h].pressed = c & ~s;
+                sw_queue[h].released = c & s;
+                sw_queue[h].state = s;
+                sw_head = n;
+                sched_wake();
+            }
+        }
+    }
+}
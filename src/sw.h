@@ -0,0 +1,43 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   MAX6818 switch debouncer. The change interrupt only samples the
+   switches and queues an event, everything else happens in the main
+   loop.
+*/
+
+#ifndef _SW_H_
+#define _SW_H_
+
+#include <stdint.h>
+
+/* Switch positions (active low on port A) */
+#define SW_TSET 0x01
+#define SW_NEXT 0x02
+#define SW_TUP 0x04
+#define SW_TDOWN 0x08
+#define SW_SHDN 0x10
+#define SW_MASK 0x1f
+
+/* Events queued (power of two) */
+#define SW_QUEUE 8
+
+typedef struct {
+    /* tick_count when sampled */
+    uint16_t tick;
+    /* Switches that went down/up */
+    uint8_t pressed;
+    uint8_t released;
+    /* Raw port A after the change */
+    uint8_t state;
+} sw_event_t;
+
+/* Last sample of the switches */
+volatile uint8_t sw_state;
+/* Events lost to a full queue */
+volatile uint8_t sw_overflows;
+
+void sw_init(void);
+uint8_t sw_get_event(sw_event_t *e);
+
+#endif
@@ -0,0 +1,303 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Host replay test for the holdover discipline loop. Each scenario
+   builds a trace of GPS PPS and DS3231 1 Hz timestamps for a CPU
+   crystal and DS3231 with known errors (plus edge jitter and the 32
+   bit timebase wrap), replays it edge by edge through
+   discipline_task() the way the PPS ISRs and the clock task would,
+   and checks:
+   - the learned ppb against the true errors
+   - GPS -> DS3231 switchover and back
+   - the holdover time error estimate against the real error of the
+     displayed second, including the slips it asks for
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "discipline.h"
+#include "timebase.h"
+#include "tick.h"
+#include "nmea.h"
+#include "mtk3339.h"
+#include "ds3231.h"
+
+static uint8_t failures = 0;
+
+#define CHECK(cond) do {                                        \
+        if (!(cond)) {                                          \
+            printf("discipline_replay: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+/* Simulated true time, seconds */
+static double now_s = 0;
+
+uint16_t tick_ms(void) {
+    return((uint16_t)(uint64_t)(now_s*1000.0));
+}
+
+typedef struct {
+    const char *name;
+    /* true oscillator errors, ppb (positive: CPU runs fast, DS3231
+       second is long) */
+    double cpu_ppb;
+    double rtc_ppb;
+    /* DS3231 edge lag behind the GPS edge at t = 0, seconds */
+    double rtc_phase;
+    /* peak edge jitter, CPU ticks */
+    uint8_t jitter;
+    /* fix for this long, lost for holdover seconds, then back */
+    uint16_t track;
+    uint16_t holdover;
+    uint16_t regain;
+} scenario_t;
+
+/* What a replay saw */
+typedef struct {
+    int32_t cpu_ppb;
+    int32_t rtc_ppb;
+    uint8_t tau;
+    uint8_t state_lost;
+    uint8_t state_end;
+    int8_t slip_end;
+    uint16_t holdover;
+    /* displayed - true at DS3231 driven edges, ticks */
+    double worst_display;
+    /* |estimate - real| of the holdover offset, ticks */
+    double worst_estimate;
+    int16_t slips;
+} replay_t;
+
+static uint32_t rand_state = 1;
+
+static int8_t jitter(uint8_t peak) {
+    rand_state = rand_state*1103515245 + 12345;
+    if (peak == 0) {
+        return 0;
+    }
+    return((int8_t)((rand_state >> 16) % (2*peak + 1)) - peak);
+}
+
+/* Timebase reading at true time t */
+static uint32_t stamp_at(const scenario_t *s, double t, uint8_t j) {
+    double ticks = t*(double)F_CPU*(1.0 + s->cpu_ppb*1e-9);
+
+    /* the timebase starts at a few seconds before its wrap */
+    return((uint32_t)(uint64_t)llround(ticks) + 0xfc000000UL + jitter(j));
+}
+
+/* Second edge driving the clock, as the INT6/INT7 ISRs mark it */
+static void mark(uint32_t stamp, uint8_t source) {
+    timebase_pps_stamp = stamp;
+    timebase_seconds++;
+    timebase_source = source;
+}
+
+static void replay(const scenario_t *s, replay_t *r) {
+    double cpu_tps = (double)F_CPU*(1.0 + s->cpu_ppb*1e-9);
+    double rtc_period = 1.0 + s->rtc_ppb*1e-9;
+    double t_gps = 1.0;
+    double t_rtc = s->rtc_phase;
+    double end_lost = s->track + s->holdover;
+    double end = end_lost + s->regain;
+    double err = 0;
+    /* displayed second, as a count of whole seconds of true time */
+    int32_t label = 0;
+    uint8_t fix = 1;
+    uint8_t lost_seen = 0;
+
+    memset(r, 0x00, sizeof(*r));
+    rand_state = 1;
+    now_s = 0;
+    gps_fix = 1;
+    mtk3339_pps_seq = 0;
+    ds3231_pps_seq = 0;
+    timebase_seconds = 0;
+    discipline_init();
+
+    while ((t_gps < end) || (t_rtc < end)) {
+        if (t_gps <= t_rtc) {
+            now_s = t_gps;
+            t_gps += 1.0;
+
+            if (fix && (now_s >= s->track) && (now_s < end_lost)) {
+                /* PPS stops with the fix, DS3231 takes over */
+                fix = 0;
+                gps_fix = 0;
+                discipline_task();
+                r->state_lost = discipline_state;
+                lost_seen = 1;
+            } else if (!fix && (now_s >= end_lost)) {
+                fix = 1;
+                gps_fix = 1;
+            }
+            if (!fix) {
+                continue;
+            }
+
+            mtk3339_pps_stamp = stamp_at(s, now_s, s->jitter);
+            mtk3339_pps_seq++;
+            mark(mtk3339_pps_stamp, TIMEBASE_SRC_GPS);
+            /* GPS labels its own edges */
+            label = (int32_t)llround(now_s);
+            discipline_task();
+        } else {
+            now_s = t_rtc;
+            t_rtc += rtc_period;
+
+            ds3231_pps_stamp = stamp_at(s, now_s, s->jitter);
+            ds3231_pps_seq++;
+            if (fix) {
+                discipline_task();
+                continue;
+            }
+
+            /* increment_time(): holds for a pending drop */
+            mark(ds3231_pps_stamp, TIMEBASE_SRC_RTC);
+            if (discipline_slip < 0) {
+                discipline_slip++;
+                r->slips--;
+            } else {
+                label++;
+            }
+            discipline_task();
+            /* clock_task(): inserts pending seconds */
+            while (discipline_slip > 0) {
+                discipline_slip--;
+                r->slips++;
+                label++;
+            }
+
+            /* Shown (with the drops still pending) against true */
+            err = ((double)(label + discipline_slip) - now_s)*cpu_tps;
+            if (fabs(err) > fabs(r->worst_display)) {
+                r->worst_display = err;
+            }
+            if (fabs(err - discipline_offset) > r->worst_estimate) {
+                r->worst_estimate = fabs(err - discipline_offset);
+            }
+        }
+
+        if (!lost_seen) {
+            r->cpu_ppb = discipline_ppb(discipline_cpu_freq);
+            r->rtc_ppb = discipline_ppb(discipline_rtc_freq);
+            r->tau = discipline_tau;
+        }
+    }
+
+    r->state_end = discipline_state;
+    r->slip_end = discipline_slip;
+    r->holdover = discipline_holdover;
+}
+
+static void report(const scenario_t *s, const replay_t *r) {
+    printf("discipline_replay: %-10s cpu %ld/%.0f ppb rtc %ld/%.0f ppb tau %u "
+           "display %.0f est %.0f ticks slips %d\n", s->name,
+           (long)r->cpu_ppb, s->cpu_ppb, (long)r->rtc_ppb, s->rtc_ppb,
+           r->tau, r->worst_display, r->worst_estimate, r->slips);
+}
+
+/* 20 ppb over the holdover plus the seeding jitter */
+static double estimate_limit(const scenario_t *s) {
+    return(20e-9*s->holdover*F_CPU + 8*s->jitter + 8);
+}
+
+/* Slow DS3231, fast crystal: learn, hold over ten minutes, resync */
+static void test_holdover(void) {
+    static const scenario_t s = {"holdover", 12500, 2000, 0.3, 2, 600, 600, 30};
+    replay_t r;
+
+    replay(&s, &r);
+    report(&s, &r);
+    CHECK(labs(r.cpu_ppb - 12500) <= 20);
+    CHECK(labs(r.rtc_ppb - 2000) <= 20);
+    CHECK(r.tau == DISCIPLINE_TAU_MAX);
+    CHECK(r.state_lost == DISCIPLINE_HOLDOVER);
+    CHECK(r.holdover >= s.holdover - 1);
+    /* Display stays on the second that has started */
+    CHECK(r.worst_display <= 0);
+    CHECK(r.worst_display > -(double)F_CPU);
+    CHECK(r.worst_estimate < estimate_limit(&s));
+    CHECK(r.state_end == DISCIPLINE_TRACK);
+    CHECK(r.slip_end == 0);
+}
+
+/* Fast DS3231 edge just after the GPS edge: the error crosses a
+   second boundary during holdover and has to drop exactly one */
+static void test_slip(void) {
+    static const scenario_t s = {"slip", -3000, -20000, 0.0085, 1, 400, 300, 10};
+    replay_t r;
+
+    replay(&s, &r);
+    report(&s, &r);
+    CHECK(labs(r.cpu_ppb + 3000) <= 20);
+    CHECK(labs(r.rtc_ppb + 20000) <= 20);
+    CHECK(r.state_lost == DISCIPLINE_HOLDOVER);
+    CHECK(r.worst_display <= 0);
+    CHECK(r.worst_display > -(double)F_CPU);
+    CHECK(r.worst_estimate < estimate_limit(&s));
+    /* one hold when the edge crossed */
+    CHECK(r.slips == -1);
+    CHECK(r.state_end == DISCIPLINE_TRACK);
+}
+
+/* Fix lost before the DS3231 estimate can be trusted: no holdover */
+static void test_short_track(void) {
+    static const scenario_t s = {"short", 12500, 2000, 0.3, 2,
+                                 DISCIPLINE_MIN_SAMPLES/2, 60, 10};
+    replay_t r;
+
+    replay(&s, &r);
+    report(&s, &r);
+    CHECK(r.state_lost == DISCIPLINE_UNLOCKED);
+    CHECK(r.holdover == 0);
+    CHECK(r.slips == 0);
+    CHECK(r.state_end == DISCIPLINE_TRACK);
+}
+
+/* Missed and out of window edges must not pull the estimate */
+static void test_glitches(void) {
+    static const scenario_t s = {"glitches", 12500, 2000, 0.3, 0, 0, 0, 0};
+    uint16_t i = 0;
+
+    discipline_init();
+    gps_fix = 1;
+    for (i = 1; i <= 300; i++) {
+        now_s = i;
+        /* every 50th edge missing, every 70th 10 ms late */
+        if ((i % 50) == 0) {
+            continue;
+        }
+        mtk3339_pps_stamp = stamp_at(&s, i, 0) + (((i % 70) == 0) ? F_CPU/100 : 0);
+        mtk3339_pps_seq = i;
+        discipline_task();
+    }
+    printf("discipline_replay: %-10s cpu %ld/%.0f ppb\n", s.name,
+           (long)discipline_ppb(discipline_cpu_freq), s.cpu_ppb);
+    CHECK(labs(discipline_ppb(discipline_cpu_freq) - 12500) <= 5);
+}
+
+static void test_ppb(void) {
+    CHECK(discipline_ppb(200L << 8) == 12500);
+    CHECK(discipline_q8(12500) == (200L << 8));
+    CHECK(discipline_ppb(discipline_q8(-2000)) == -2000);
+}
+
+int main(void) {
+    test_ppb();
+    test_glitches();
+    test_holdover();
+    test_slip();
+    test_short_track();
+
+    if (failures) {
+        printf("discipline_replay: %u checks failed\n", failures);
+        return 1;
+    }
+    printf("discipline_replay: ok\n");
+    return 0;
+}
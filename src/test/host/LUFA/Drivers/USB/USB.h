@@ -0,0 +1,22 @@
+/* Host stand-in for LUFA's USB.h: just enough of the types for
+   main.h and descriptors.h, no USB stack */
+#ifndef _HOST_USB_H_
+#define _HOST_USB_H_
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#define ENDPOINT_DIR_IN 0x80
+#define ENDPOINT_DIR_OUT 0x00
+#define ATTR_WARN_UNUSED_RESULT
+#define ATTR_NON_NULL_PTR_ARG(...)
+
+typedef struct { uint8_t unused; } USB_Descriptor_Configuration_Header_t;
+typedef struct { uint8_t unused; } USB_Descriptor_Interface_t;
+typedef struct { uint8_t unused; } USB_Descriptor_Endpoint_t;
+typedef struct { uint8_t unused; } USB_CDC_Descriptor_FunctionalHeader_t;
+typedef struct { uint8_t unused; } USB_CDC_Descriptor_FunctionalACM_t;
+typedef struct { uint8_t unused; } USB_CDC_Descriptor_FunctionalUnion_t;
+typedef struct { uint8_t unused; } USB_ClassInfo_CDC_Device_t;
+
+#endif
@@ -0,0 +1,10 @@
+/* Host stand-in for avr-libc's interrupt.h: an ISR is a plain
+   function the test calls */
+#ifndef _HOST_INTERRUPT_H_
+#define _HOST_INTERRUPT_H_
+
+#define ISR(vector) void vector(void)
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,41 @@
+/* Host stand-in for avr-libc's io.h. Registers are plain variables
+   the tests read and poke, only what the tested modules touch. */
+#ifndef _HOST_IO_H_
+#define _HOST_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+/* TWI. TWCR and PIND are read through the test's bus model (if it
+   has one) so a STOP can complete while the driver polls for it and
+   the pins show what the slave does. */
+volatile uint8_t *host_twcr(void);
+#define TWCR (*host_twcr())
+volatile uint8_t TWSR;
+volatile uint8_t TWBR;
+volatile uint8_t TWDR;
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+#define TWPS1 1
+#define TWPS0 0
+
+/* Port D (TWI pins) */
+volatile uint8_t PORTD;
+volatile uint8_t DDRD;
+volatile uint8_t *host_pind(void);
+#define PIND (*host_pind())
+#define PD0 0
+#define PD1 1
+
+/* Timer1 (timebase) */
+volatile uint16_t TCNT1;
+volatile uint8_t TIFR1;
+#define TOV1 0
+
+#endif
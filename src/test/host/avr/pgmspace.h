@@ -0,0 +1,23 @@
+/* Host stand-in for avr-libc's pgmspace.h: flash is plain memory */
+#ifndef _HOST_PGMSPACE_H_
+#define _HOST_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char *
+#define pgm_read_byte(a) (*(const uint8_t *)(a))
+/* Reads the object itself, so words in flash that hold function
+   pointers (one word on AVR) survive 64 bit host pointers */
+#define pgm_read_word(a) (*(a))
+#define pgm_read_dword(a) (*(const uint32_t *)(a))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strncmp_P strncmp
+#define sprintf_P sprintf
+#define printf_P printf
+
+#endif
@@ -0,0 +1,10 @@
+/* Host stand-in for avr-libc's atomic.h: the tests are single
+   threaded */
+#ifndef _HOST_ATOMIC_H_
+#define _HOST_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) for (int _atomic_once = 1; _atomic_once; _atomic_once = 0)
+
+#endif
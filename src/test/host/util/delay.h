@@ -0,0 +1,8 @@
+/* Host stand-in for avr-libc's delay.h */
+#ifndef _HOST_DELAY_H_
+#define _HOST_DELAY_H_
+
+#define _delay_us(us)
+#define _delay_ms(ms)
+
+#endif
@@ -0,0 +1,385 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Host checks and throughput benchmark for the in place NMEA
+   parser. The checks feed hand built sentences through
+   nmea_parse_sentence() and look at what got published. The
+   benchmark runs one second of 5 Hz MTK3339 output through the
+   parser and through the old three pass nmea_parse() (kept below,
+   reading the same kind of ring buffer it used to) and prints the
+   time per byte of each. The old parser never checked the
+   checksum, the new one does. Host timings only give the ratio, not
+   AVR cycles.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <avr/pgmspace.h>
+#include "uart.h"
+#include "nmea.h"
+
+#define BENCH_PASSES 20000
+
+static uint8_t failures = 0;
+
+#define CHECK(cond) do {                                        \
+        if (!(cond)) {                                          \
+            printf("nmea_bench: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+/* Finish "$...": append *hh\r\n for the bytes between '$' and '*' */
+static uint8_t nmea_frame(char *out, const char *body) {
+    uint8_t cksum = 0;
+    const char *p = body + 1;
+
+    while (*p) {
+        cksum ^= (uint8_t)*p++;
+    }
+    return(sprintf(out, "%s*%02X\r\n", body, cksum));
+}
+
+static void feed(const char *body) {
+    char s[128];
+    uint8_t len = nmea_frame(s, body);
+
+    nmea_parse_sentence((const uint8_t *)s, len, 0);
+}
+
+static void feed_raw(const char *s) {
+    nmea_parse_sentence((const uint8_t *)s, strlen(s), 0);
+}
+
+/* One second of default 5 Hz output */
+static const char *corpus[] = {
+    "$GPGGA,064951.000,2307.1256,N,12016.4438,E,1,8,0.95,39.9,M,17.8,M,,",
+    "$GPGSA,A,3,29,21,26,15,18,09,06,10,,,,,2.32,0.95,2.11",
+    "$GPGSV,3,1,09,29,36,029,42,21,46,314,43,26,44,020,43,15,21,321,39",
+    "$GPGSV,3,2,09,18,26,314,40,09,57,170,44,06,20,229,37,10,26,084,37",
+    "$GPGSV,3,3,09,07,,,26",
+    "$GPRMC,064951.000,A,2307.1256,N,12016.4438,E,0.03,165.48,260406,3.05,W,A",
+    "$GPVTG,165.48,T,,M,0.03,N,0.06,K,A",
+    "$PGTOP,11,2",
+};
+#define CORPUS_SENTENCES (sizeof(corpus)/sizeof(corpus[0]))
+
+static void test_rmc(void) {
+    nmea_flush();
+    feed("$GPRMC,064951.250,A,2307.1256,N,12016.4438,E,0.03,165.48,260406,3.05,W,A");
+    CHECK(gprmc == 1);
+    CHECK(npackets == 1);
+    CHECK(gps_time.hours == 6);
+    CHECK(gps_time.minutes == 49);
+    CHECK(gps_time.seconds == 51);
+    CHECK(gps_time_ms == 250);
+    CHECK(gps_date.day == 26);
+    CHECK(gps_date.month == 4);
+    CHECK(gps_date.year == 6);
+    CHECK(strcmp(gps_time_s, "064951.250") == 0);
+    CHECK((gps_talker[0] == 'G') && (gps_talker[1] == 'P'));
+
+    /* Multi-constellation talker lands in the same handler */
+    feed("$GNRMC,064952.000,A,2307.1256,N,12016.4438,E,0.03,165.48,260406,3.05,W,A");
+    CHECK(gprmc == 2);
+    CHECK(gps_time.seconds == 52);
+    CHECK(gps_talker[1] == 'N');
+
+    /* Void fix counts but keeps the last good time */
+    feed("$GPRMC,064953.000,V,,,,,,,260406,,,N");
+    CHECK(gprmc == 3);
+    CHECK(gps_time.seconds == 52);
+}
+
+static void test_framing(void) {
+    nmea_flush();
+
+    /* Bad checksum */
+    feed_raw("$GPRMC,064951.000,A,2307.1256,N,12016.4438,E,0.03,165.48,260406,3.05,W,A*00\r\n");
+    CHECK(gprmc == 0);
+    CHECK(nmea_errors == 1);
+
+    /* No checksum at all */
+    feed_raw("$GPGSA,A,3,29,21,,,,,,,,,,,2.32,0.95,2.11\r\n");
+    CHECK(gpgsa == 0);
+    CHECK(nmea_errors == 2);
+
+    /* Longer than NMEA allows */
+    feed_raw("$GPGSV,3,1,09,29,36,029,42,21,46,314,43,26,44,020,43,15,21,321,39,"
+             "18,26,314,40,09,57,170,44*00\r\n");
+    CHECK(nmea_errors == 3);
+
+    /* A cut off sentence is dropped, the next one parses */
+    nmea_parse_sentence((const uint8_t *)"$GPGSA,A,3", 10, 0);
+    CHECK(nmea_errors == 4);
+    feed("$GPGSA,A,3,29,21,26,15,18,09,06,10,,,,,2.32,0.95,2.11");
+    CHECK(gpgsa == 1);
+    CHECK(gps_fix == 1);
+
+    feed("$GPGSA,A,1,,,,,,,,,,,,,,,");
+    CHECK(gps_fix == 0);
+
+    /* No fix field: not the last sentence's fix */
+    feed("$GPGSA,A,3,29,21,26,15,18,09,06,10,,,,,2.32,0.95,2.11");
+    CHECK(gps_fix == 1);
+    feed("$GPGSA,A");
+    CHECK(gpgsa == 4);
+    CHECK(gps_fix == 0);
+
+    /* Unregistered sentences still count as packets */
+    feed("$GPVTG,165.48,T,,M,0.03,N,0.06,K,A");
+    CHECK(npackets == 5);
+}
+
+static void test_pmtk(void) {
+    nmea_flush();
+
+    feed("$PMTK001,314,3");
+    CHECK(pmtk_ack == 1);
+    CHECK(pmtk_nack == 0);
+    CHECK(pmtk_ack_cmd == 314);
+    CHECK(pmtk_ack_flag == PMTK_ACK_OK);
+
+    feed("$PMTK001,220,2");
+    CHECK(pmtk_nack == 1);
+    CHECK(pmtk_ack_cmd == 220);
+    CHECK(pmtk_ack_flag == PMTK_ACK_FAILED);
+
+    /* Missing or broken fields must not republish the last flag */
+    pmtk_ack = 0;
+    pmtk_nack = 0;
+    feed("$PMTK001,314");
+    feed("$PMTK001,314,");
+    feed("$PMTK001,,3");
+    feed("$PMTK001,3x4,3");
+    feed("$PMTK001,314,33");
+    CHECK(pmtk_ack == 0);
+    CHECK(pmtk_nack == 0);
+    CHECK(pmtk_ack_cmd == 220);
+
+    /* Other PMTK sentences are not acks */
+    feed("$PMTK010,001");
+    CHECK(pmtk_ack == 0);
+    CHECK(pmtk_nack == 0);
+
+    feed("$PGTOP,11,2");
+    CHECK(pgtop == 1);
+}
+
+/* The old parser, as it was before the rewrite. The LUFA ring
+   buffer it read is replaced by the same simple ring. */
+#define OLD_RING_SIZE 128
+
+static uint8_t old_ring[OLD_RING_SIZE];
+static uint8_t old_ring_in = 0;
+static uint8_t old_ring_out = 0;
+static uint8_t old_ring_count = 0;
+
+static inline void old_ring_insert(uint8_t c) {
+    old_ring[old_ring_in] = c;
+    old_ring_in = (old_ring_in + 1) % OLD_RING_SIZE;
+    old_ring_count++;
+}
+
+static inline uint8_t old_ring_remove(void) {
+    uint8_t c = old_ring[old_ring_out];
+
+    old_ring_out = (old_ring_out + 1) % OLD_RING_SIZE;
+    old_ring_count--;
+    return(c);
+}
+
+#define OLD_UTC_ENTRY_LEN 10
+
+static uint8_t packet_buf[128];
+static uint8_t packet_buf_pos = 0;
+static uint8_t start_flag = 0;
+static uint8_t stop_flag_r = 0;
+static uint8_t packet_flag = 0;
+
+static void old_nmea_parse(void) {
+    uint8_t count = 0;
+    uint8_t i = 0;
+    uint8_t j = 0;
+    uint8_t rx_byte = 0;
+    uint8_t utc_place = 0;
+
+    count = old_ring_count;
+
+    if (!start_flag) {
+        for (i = 0; i < count; i++) {
+            rx_byte = old_ring_remove();
+            if (rx_byte == '$') {
+                packet_buf[0] = rx_byte;
+                packet_buf_pos++;
+                start_flag = 1;
+                break;
+            }
+        }
+    }
+
+    if (!stop_flag_r && start_flag) {
+        count = old_ring_count;
+        for (i = 0; i < count; i++) {
+            rx_byte = old_ring_remove();
+            if (rx_byte == '\r') {
+                stop_flag_r = 1;
+                packet_buf[packet_buf_pos] = rx_byte;
+                packet_buf_pos++;
+                break;
+            } else {
+                packet_buf[packet_buf_pos] = rx_byte;
+                packet_buf_pos++;
+            }
+        }
+    }
+
+    if (!packet_flag && start_flag && stop_flag_r) {
+        count = old_ring_count;
+        if (count > 0) {
+            rx_byte = old_ring_remove();
+            if (rx_byte == '\n') {
+                packet_buf[packet_buf_pos] = rx_byte;
+                packet_buf_pos++;
+                packet_flag = 1;
+            }
+        }
+    }
+
+    if (packet_flag) {
+        if (strncmp((char*)packet_buf, "$PGTOP", 6) == 0) {
+            pgtop++;
+        } else if (strncmp((char*)packet_buf, "$GPGSA", 6) == 0) {
+            i = 5;
+            while(packet_buf[i++] != ',');
+            while(packet_buf[i++] != ',');
+            if ((char)packet_buf[i] == '3') {
+                gps_fix = 1;
+            } else {
+                gps_fix = 0;
+            }
+            gpgsa++;
+        } else if (strncmp((char*)packet_buf, "$GPRMC", 6) == 0) {
+            i = 5;
+            while(packet_buf[i++] != ',');
+            utc_place = i;
+            while(packet_buf[i++] != ',');
+            if ((char)packet_buf[i] == 'A') {
+                if ((i - utc_place) == (OLD_UTC_ENTRY_LEN + 1)) {
+                    gps_time.hours = (packet_buf[utc_place] - '0')*10 + (packet_buf[utc_place + 1] - '0');
+                    gps_time.minutes = (packet_buf[utc_place + 2] - '0')*10 + (packet_buf[utc_place + 3] - '0');
+                    gps_time.seconds = (packet_buf[utc_place + 4] - '0')*10 + (packet_buf[utc_place + 5] - '0');
+                    memset(gps_time_s, 0x00, sizeof(gps_time_s));
+                    for (j = 0; j < OLD_UTC_ENTRY_LEN; j++) {
+                        gps_time_s[j] = (char)packet_buf[utc_place + j];
+                    }
+                }
+                while(packet_buf[i++] != ',');
+                while(packet_buf[i++] != ',');
+                while(packet_buf[i++] != ',');
+                while(packet_buf[i++] != ',');
+                while(packet_buf[i++] != ',');
+                while(packet_buf[i++] != ',');
+                while(packet_buf[i++] != ',');
+                j = i;
+                while(packet_buf[j++] != ',');
+                if ((j - i) == 7) {
+                    gps_date.day = (packet_buf[i] - '0')*10 + (packet_buf[i + 1] - '0');
+                    gps_date.month = (packet_buf[i + 2] - '0')*10 + (packet_buf[i + 3] - '0');
+                    gps_date.year = (packet_buf[i + 4] - '0')*10 + (packet_buf[i + 5] - '0');
+                }
+            }
+            gprmc++;
+        } else if (strncmp((char*)packet_buf, "$PMTK001", 8) == 0) {
+            i = 7;
+            while(packet_buf[i++] != ',');
+            while(packet_buf[i++] != ',');
+            if ((char)packet_buf[i] == '3') {
+                pmtk_ack = 1;
+            } else {
+                pmtk_nack = 1;
+            }
+        }
+
+        npackets++;
+
+        start_flag = 0;
+        stop_flag_r = 0;
+        packet_flag = 0;
+        packet_buf_pos = 0;
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec*1e9 + ts.tv_nsec);
+}
+
+static void bench(void) {
+    static char frames[CORPUS_SENTENCES][128];
+    static uint8_t lens[CORPUS_SENTENCES];
+    uint32_t bytes = 0;
+    uint32_t pass = 0;
+    uint8_t i = 0;
+    uint8_t j = 0;
+    double t0 = 0;
+    double t_old = 0;
+    double t_new = 0;
+
+    for (i = 0; i < CORPUS_SENTENCES; i++) {
+        lens[i] = nmea_frame(frames[i], corpus[i]);
+        bytes += lens[i];
+    }
+
+    /* Old: the RX ISR filled the ring, the main loop scanned it */
+    nmea_flush();
+    t0 = now_ns();
+    for (pass = 0; pass < BENCH_PASSES; pass++) {
+        for (i = 0; i < CORPUS_SENTENCES; i++) {
+            for (j = 0; j < lens[i]; j++) {
+                old_ring_insert(frames[i][j]);
+            }
+            while (old_ring_count) {
+                old_nmea_parse();
+            }
+        }
+    }
+    t_old = now_ns() - t0;
+    CHECK(gprmc == (uint8_t)BENCH_PASSES);
+
+    /* New: the RX ISR fills a slot, the parser walks it once */
+    nmea_flush();
+    t0 = now_ns();
+    for (pass = 0; pass < BENCH_PASSES; pass++) {
+        for (i = 0; i < CORPUS_SENTENCES; i++) {
+            for (j = 0; j < lens[i]; j++) {
+                uart_rx_slot[0][j] = frames[i][j];
+            }
+            nmea_parse_sentence(uart_rx_slot[0], lens[i], 0);
+        }
+    }
+    t_new = now_ns() - t0;
+    CHECK(gprmc == (uint8_t)BENCH_PASSES);
+    CHECK(nmea_errors == 0);
+
+    bytes *= BENCH_PASSES;
+    printf("nmea_bench: %lu bytes, old %.2f ns/byte, new %.2f ns/byte (%.2fx)\n",
+           (unsigned long)bytes, t_old/bytes, t_new/bytes, t_old/t_new);
+}
+
+int main(void) {
+    test_rmc();
+    test_framing();
+    test_pmtk();
+    bench();
+
+    if (failures) {
+        printf("nmea_bench: %u checks failed\n", failures);
+        return 1;
+    }
+    printf("nmea_bench: ok\n");
+    return 0;
+}
@@ -0,0 +1,463 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Host harness for the TWI master. twi_master.c is built as is; this
+   file stands in for the TWI unit, the bus pins and a DS3231-like
+   slave (a register file with an auto incrementing pointer).
+
+   Whenever the driver writes a command to TWCR (TWINT set) the model
+   works out what the bus would do, sets TWSR (and TWDR for reads) and
+   calls the ISR. The slave can be told to NACK addresses or data,
+   hang the bus (no interrupt, the driver has to time out), report a
+   bus error, or hold SDA low until it has seen some SCL clocks.
+   Time only moves in run(), one tick per ms, which calls TWI_task()
+   as the main loop would and TWI_tick() as the 1 kHz tick ISR would.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "twi_master.h"
+#include "tick.h"
+
+#define SLAVE_ADDR 0x68
+
+static uint8_t failures = 0;
+
+#define CHECK(cond) do {                                        \
+        if (!(cond)) {                                          \
+            printf("twi_sim: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+void TWI_vect(void);
+
+/* Bus phases as the model sees them */
+#define BUS_IDLE 0
+#define BUS_ADDR 1 // START sent, SLA+R/W next
+#define BUS_POINTER 2 // SLA+W acked, register pointer next
+#define BUS_WRITE 3
+#define BUS_READ 4
+#define BUS_NACKED 5
+
+typedef struct {
+    uint8_t regs[32];
+    uint8_t ptr;
+    /* faults, each counts down as it is used */
+    uint8_t nack_addr;
+    uint8_t nack_data;
+    uint8_t hang;
+    uint8_t bus_error;
+    /* after a bus error SDA is held for this many SCL clocks */
+    uint8_t error_stuck;
+    /* SDA held low until this many SCL clocks have been seen */
+    uint8_t sda_stuck;
+    /* STOP never leaves TWCR */
+    uint8_t stop_stuck;
+} slave_t;
+
+static slave_t slave;
+static uint8_t bus_phase = BUS_IDLE;
+static uint8_t twcr_reg = 0;
+static uint8_t pind_reg = 0;
+static uint8_t scl_driven = 0;
+/* SCL clocks the driver gave during recovery, and the most in one */
+static uint16_t scl_clocks = 0;
+static uint16_t sim_ms = 0;
+
+uint16_t tick_ms(void) {
+    return(sim_ms);
+}
+
+volatile uint8_t *host_twcr(void) {
+    /* STOP goes out as soon as the driver looks for it */
+    if ((twcr_reg & (1 << TWSTO)) && !slave.stop_stuck) {
+        twcr_reg &= ~(1 << TWSTO);
+        bus_phase = BUS_IDLE;
+    }
+    return(&twcr_reg);
+}
+
+volatile uint8_t *host_pind(void) {
+    pind_reg = (1 << TWI_SCL) | (1 << TWI_SDA);
+    if (DDRD & (1 << TWI_SCL)) {
+        pind_reg &= ~(1 << TWI_SCL);
+    }
+    if ((DDRD & (1 << TWI_SDA)) || slave.sda_stuck) {
+        pind_reg &= ~(1 << TWI_SDA);
+    }
+    return(&pind_reg);
+}
+
+/* Count SCL clocks driven by hand, the slave lets go of SDA after
+   enough of them */
+static void watch_scl(void) {
+    uint8_t driven = (DDRD & (1 << TWI_SCL)) != 0;
+
+    if (scl_driven && !driven) {
+        scl_clocks++;
+        if (slave.sda_stuck) {
+            slave.sda_stuck--;
+        }
+    }
+    scl_driven = driven;
+}
+
+/* Act on a pending TWCR command. Returns 1 if the ISR was run. */
+static uint8_t bus_step(void) {
+    uint8_t cmd = twcr_reg;
+    uint8_t status = 0;
+
+    if (!(cmd & (1 << TWINT)) || !(cmd & (1 << TWEN))) {
+        return 0;
+    }
+    twcr_reg &= ~(1 << TWINT);
+
+    if (cmd & (1 << TWSTO)) {
+        return 0;
+    }
+
+    if (slave.hang) {
+        /* Nothing ever comes back */
+        slave.hang--;
+        return 0;
+    }
+
+    if (cmd & (1 << TWSTA)) {
+        if (slave.sda_stuck) {
+            /* Bus looks busy, the START never goes out */
+            return 0;
+        }
+        if (slave.bus_error) {
+            slave.bus_error--;
+            slave.sda_stuck = slave.error_stuck;
+            status = 0x00;
+            bus_phase = BUS_IDLE;
+        } else {
+            status = (bus_phase == BUS_IDLE) ? TWI_start_sent : TWI_repeated_start_sent;
+            bus_phase = BUS_ADDR;
+        }
+    } else {
+        switch (bus_phase) {
+        case BUS_ADDR:
+            if (((TWDR >> 1) != SLAVE_ADDR) || slave.nack_addr) {
+                if (slave.nack_addr) {
+                    slave.nack_addr--;
+                }
+                status = (TWDR & 0x01) ? TWI_SLA_R_sent_nack_received : TWI_SLA_W_sent_nack_received;
+                bus_phase = BUS_NACKED;
+            } else if (TWDR & 0x01) {
+                status = TWI_SLA_R_sent_ack_received;
+                bus_phase = BUS_READ;
+            } else {
+                status = TWI_SLA_W_sent_ack_received;
+                bus_phase = BUS_POINTER;
+            }
+            break;
+        case BUS_POINTER:
+        case BUS_WRITE:
+            if (slave.nack_data) {
+                slave.nack_data--;
+                status = TWI_data_sent_nack_received;
+                bus_phase = BUS_NACKED;
+                break;
+            }
+            if (bus_phase == BUS_POINTER) {
+                slave.ptr = TWDR;
+            } else {
+                slave.regs[slave.ptr++ % sizeof(slave.regs)] = TWDR;
+            }
+            status = TWI_data_sent_ack_received;
+            bus_phase = BUS_WRITE;
+            break;
+        case BUS_READ:
+            TWDR = slave.regs[slave.ptr++ % sizeof(slave.regs)];
+            status = (cmd & (1 << TWEA)) ? TWI_data_received_ack_returned :
+                TWI_data_received_nack_returned;
+            break;
+        default:
+            /* TWI_ACK with nothing going on (init, recovery done) */
+            return 0;
+        }
+    }
+
+    TWSR = status;
+    TWI_vect();
+    return 1;
+}
+
+static void bus_settle(void) {
+    uint16_t guard = 0;
+
+    while (bus_step() && (++guard < 1000));
+    CHECK(guard < 1000);
+}
+
+/* Main loop and tick for ms milliseconds */
+static void run(uint16_t ms) {
+    while (ms--) {
+        bus_settle();
+        TWI_task();
+        bus_settle();
+        sim_ms++;
+        TWI_tick();
+        watch_scl();
+    }
+}
+
+/* Run until t is finished, returns the ms it took */
+static uint16_t run_until(TWI_transaction_t *t, uint16_t limit) {
+    uint16_t start = sim_ms;
+
+    while (((t->status == TWI_TRANS_QUEUED) || (t->status == TWI_TRANS_ACTIVE)) &&
+           ((uint16_t)(sim_ms - start) < limit)) {
+        run(1);
+    }
+    return(sim_ms - start);
+}
+
+static void reset(void) {
+    memset(&slave, 0x00, sizeof(slave));
+    bus_phase = BUS_IDLE;
+    twcr_reg = 0;
+    DDRD = 0;
+    PORTD = 0;
+    scl_driven = 0;
+    scl_clocks = 0;
+    TWI_nacks = 0;
+    TWI_timeouts = 0;
+    TWI_recoveries = 0;
+    TWI_failures = 0;
+    TWI_init();
+}
+
+static void xfer(TWI_transaction_t *t, uint8_t reg, const volatile uint8_t *w,
+                 uint8_t wn, volatile uint8_t *r, uint8_t rn) {
+    memset(t, 0x00, sizeof(*t));
+    t->addr = SLAVE_ADDR;
+    t->flags = TWI_FLAG_REG;
+    t->reg = reg;
+    t->write_buf = w;
+    t->write_bytes = wn;
+    t->read_buf = r;
+    t->read_bytes = rn;
+}
+
+static void test_clean(void) {
+    static const uint8_t w[3] = {0x45, 0x23, 0x12};
+    static volatile uint8_t r[3];
+    TWI_transaction_t tw;
+    TWI_transaction_t tr;
+
+    reset();
+    xfer(&tw, 0x00, w, 3, NULL, 0);
+    xfer(&tr, 0x00, NULL, 0, r, 3);
+    CHECK(TWI_queue(&tw) == 0);
+    CHECK(TWI_queue(&tr) == 0);
+    run_until(&tr, 100);
+
+    CHECK(tw.status == TWI_TRANS_DONE);
+    CHECK(tr.status == TWI_TRANS_DONE);
+    CHECK(memcmp(slave.regs, w, 3) == 0);
+    CHECK(memcmp((const void *)r, w, 3) == 0);
+    CHECK(TWI_nacks == 0);
+    CHECK(TWI_recoveries == 0);
+}
+
+/* A couple of NACKs are retried away */
+static void test_nack_retry(void) {
+    static const uint8_t w[1] = {0x5a};
+    TWI_transaction_t t;
+
+    reset();
+    slave.nack_addr = 1;
+    slave.nack_data = 1;
+    xfer(&t, 0x10, w, 1, NULL, 0);
+    TWI_queue(&t);
+    run_until(&t, 100);
+
+    CHECK(t.status == TWI_TRANS_DONE);
+    CHECK(t.error == TWI_ERR_NONE);
+    CHECK(TWI_nacks == 2);
+    CHECK(TWI_failures == 0);
+    CHECK(slave.regs[0x10] == 0x5a);
+}
+
+/* Nobody answers the address: fails after TWI_RETRIES, the next
+   transaction still gets the bus */
+static void test_nack_fail(void) {
+    static volatile uint8_t r[2];
+    TWI_transaction_t t;
+    TWI_transaction_t next;
+
+    reset();
+    slave.regs[0x11] = 0x19;
+    slave.regs[0x12] = 0x40;
+    xfer(&t, 0x11, NULL, 0, r, 2);
+    t.addr = SLAVE_ADDR + 1;
+    xfer(&next, 0x11, NULL, 0, r, 2);
+    TWI_queue(&t);
+    TWI_queue(&next);
+    run_until(&t, 100);
+
+    CHECK(t.status == TWI_TRANS_ERROR);
+    CHECK(t.error == TWI_ERR_NACK);
+    CHECK(TWI_nacks == TWI_RETRIES + 1);
+    CHECK(TWI_failures == 1);
+
+    run_until(&next, 100);
+    CHECK(next.status == TWI_TRANS_DONE);
+    CHECK((r[0] == 0x19) && (r[1] == 0x40));
+}
+
+/* Lost interrupt: timed out, bus recovered from the tick, retried */
+static void test_timeout(void) {
+    static const uint8_t w[2] = {0x01, 0x02};
+    TWI_transaction_t t;
+    uint16_t ms = 0;
+
+    reset();
+    slave.hang = 1;
+    xfer(&t, 0x00, w, 2, NULL, 0);
+    TWI_queue(&t);
+    ms = run_until(&t, 200);
+
+    CHECK(t.status == TWI_TRANS_DONE);
+    CHECK(TWI_timeouts == 1);
+    CHECK(TWI_recoveries == 1);
+    /* SDA was free, so no clocks, just START/STOP */
+    CHECK(scl_clocks == 0);
+    CHECK(ms > TWI_TIMEOUT_MS);
+    CHECK((slave.regs[0] == 0x01) && (slave.regs[1] == 0x02));
+}
+
+/* Slave holding SDA after a bus error: clocked free one SCL half
+   period per tick, then the transfer goes through */
+static void test_stuck_sda(void) {
+    static const uint8_t w[1] = {0x77};
+    TWI_transaction_t t;
+    uint16_t ms = 0;
+
+    reset();
+    slave.bus_error = 1;
+    slave.error_stuck = 5;
+    xfer(&t, 0x03, w, 1, NULL, 0);
+    TWI_queue(&t);
+    ms = run_until(&t, 200);
+
+    CHECK(t.status == TWI_TRANS_DONE);
+    CHECK(TWI_recoveries == 1);
+    CHECK(TWI_timeouts == 0);
+    CHECK(scl_clocks == 5);
+    /* 5 clocks at 2 ms each plus release, START and STOP */
+    CHECK(ms >= 2*5 + 3);
+    CHECK(slave.regs[0x03] == 0x77);
+}
+
+/* SDA never comes back: at most 9 clocks per recovery, no timeouts
+   counted while recovering, and the transaction gives up */
+static void test_stuck_forever(void) {
+    static volatile uint8_t r[1];
+    TWI_transaction_t t;
+
+    reset();
+    slave.sda_stuck = 0xff;
+    xfer(&t, 0x00, NULL, 0, r, 1);
+    TWI_queue(&t);
+    run_until(&t, 1000);
+    /* the last recovery still runs after the transaction gave up */
+    run(30);
+
+    CHECK(t.status == TWI_TRANS_ERROR);
+    CHECK(t.error == TWI_ERR_TIMEOUT);
+    CHECK(TWI_timeouts == TWI_RETRIES + 1);
+    CHECK(TWI_recoveries == TWI_RETRIES + 1);
+    CHECK(scl_clocks == 9*(TWI_RETRIES + 1));
+    CHECK(TWI_failures == 1);
+}
+
+/* STOP that never leaves: recovered, the next one still runs */
+static void test_stop_stuck(void) {
+    static const uint8_t w[1] = {0x33};
+    TWI_transaction_t t;
+    TWI_transaction_t next;
+
+    reset();
+    slave.stop_stuck = 1;
+    xfer(&t, 0x05, w, 1, NULL, 0);
+    xfer(&next, 0x06, w, 1, NULL, 0);
+    TWI_queue(&t);
+    TWI_queue(&next);
+    bus_settle();
+    slave.stop_stuck = 0;
+    run_until(&next, 100);
+
+    CHECK(t.status == TWI_TRANS_DONE);
+    CHECK(next.status == TWI_TRANS_DONE);
+    CHECK(TWI_recoveries == 1);
+    CHECK(slave.regs[0x06] == 0x33);
+}
+
+/* Completion callbacks chaining reads and writes, as the aging
+   calibration does: write, then read-modify-write of another
+   register from the callbacks */
+static TWI_transaction_t chain_a;
+static TWI_transaction_t chain_b;
+static volatile uint8_t chain_buf;
+
+static void chain_b_done(TWI_transaction_t *t) {
+    if ((t->status != TWI_TRANS_DONE) || t->write_bytes) {
+        return;
+    }
+    chain_buf |= 0x20;
+    t->write_bytes = 1;
+    t->read_bytes = 0;
+    t->write_buf = &chain_buf;
+    t->read_buf = NULL;
+    TWI_queue(t);
+}
+
+static void chain_a_done(TWI_transaction_t *t) {
+    if (t->status != TWI_TRANS_DONE) {
+        return;
+    }
+    xfer(&chain_b, 0x0e, NULL, 0, &chain_buf, 1);
+    chain_b.done = chain_b_done;
+    TWI_queue(&chain_b);
+}
+
+static void test_chain(void) {
+    static const uint8_t aging[1] = {0xfd};
+
+    reset();
+    slave.regs[0x0e] = 0x1c;
+    xfer(&chain_a, 0x10, aging, 1, NULL, 0);
+    chain_a.done = chain_a_done;
+    TWI_queue(&chain_a);
+    run(20);
+
+    CHECK(chain_a.status == TWI_TRANS_DONE);
+    CHECK(chain_b.status == TWI_TRANS_DONE);
+    CHECK(slave.regs[0x10] == 0xfd);
+    CHECK(slave.regs[0x0e] == 0x3c);
+}
+
+int main(void) {
+    test_clean();
+    test_nack_retry();
+    test_nack_fail();
+    test_timeout();
+    test_stuck_sda();
+    test_stuck_forever();
+    test_stop_stuck();
+    test_chain();
+
+    if (failures) {
+        printf("twi_sim: %u checks failed\n", failures);
+        return 1;
+    }
+    printf("twi_sim: ok\n");
+    return 0;
+}
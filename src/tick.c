@@ -0,0 +1,43 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   1 kHz system tick (Timer0)
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "tick.h"
+#include "twi_master.h"
+#include "sched.h"
+
+/* Timer0 in CTC mode, 16 MHz / 64 / 250 = 1 kHz */
+void tick_init(void) {
+    tick_count = 0;
+
+    TCCR0A = (1 << WGM01);
+    OCR0A = (F_CPU/64/1000) - 1;
+    TCNT0 = 0;
+    TIMSK0 |= (1 << OCIE0A);
+    TCCR0B = (1 << CS01) | (1 << CS00);
+}
+
+/* Current tick, read atomically */
+uint16_t tick_ms(void) {
+    uint16_t t = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        t = tick_count;
+    }
+
+    return t;
+}
+
+ISR(TIMER0_COMPA_vect) {
+    tick_count++;
+    /* Periodic tasks may be due */
+    sched_wake();
+
+    /* TWI bus recovery runs at one SCL half period per tick */
+    TWI_tick();
+}
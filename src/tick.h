@@ -0,0 +1,24 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   1 kHz system tick (Timer0)
+*/
+
+#ifndef _TICK_H_
+#define _TICK_H_
+
+#include <stdint.h>
+
+/* Milliseconds since boot, wraps every ~65 s. Compare with
+   tick_since() rather than directly. */
+volatile uint16_t tick_count;
+
+void tick_init(void);
+uint16_t tick_ms(void);
+
+/* Milliseconds elapsed since t (wrap safe) */
+static inline uint16_t tick_since(uint16_t t) {
+    return(tick_ms() - t);
+}
+
+#endif
@@ -0,0 +1,86 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Free running 32 bit timebase (Timer1 at F_CPU)
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "timebase.h"
+
+/* Timer1 in normal mode, no prescaler, overflow extends it to 32
+   bits */
+void timebase_init(void) {
+    timebase_overflows = 0;
+    timebase_pps_stamp = 0;
+    timebase_period = F_CPU;
+    timebase_seconds = 0;
+    timebase_source = 0xff;
+
+    TCCR1A = 0x00;
+    TCCR1B = 0x00;
+    TCNT1 = 0;
+    TIFR1 = (1 << TOV1);
+    TIMSK1 |= (1 << TOIE1);
+    TCCR1B = (1 << CS10);
+}
+
+/* Called from the PPS ISR that is driving the_time, with the
+   timestamp taken on entry. The period is only updated from two
+   consecutive edges of the same source, so a source switch or a missed
+   edge leaves the last good measurement in place. */
+void timebase_mark(uint32_t stamp, uint8_t source) {
+    uint32_t d = stamp - timebase_pps_stamp;
+
+    if ((source == timebase_source) &&
+        (d > (F_CPU - TIMEBASE_PERIOD_WINDOW)) &&
+        (d < (F_CPU + TIMEBASE_PERIOD_WINDOW))) {
+        timebase_period = d;
+    }
+
+    timebase_source = source;
+    timebase_pps_stamp = stamp;
+    timebase_seconds++;
+}
+
+/* Seconds and microseconds since timebase_init(), interpolated from the
+   last edge using the measured length of a second. Nothing runs
+   between edges; all the work is done here. Whole seconds past the
+   last edge (no edge arrived) are extrapolated. */
+void timebase_now(timebase_time_t *t) {
+    uint32_t stamp = 0;
+    uint32_t period = 0;
+    uint32_t seconds = 0;
+    uint32_t elapsed = 0;
+    uint32_t us = 0;
+    int32_t err = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        elapsed = timebase_ticks();
+        stamp = timebase_pps_stamp;
+        period = timebase_period;
+        seconds = timebase_seconds;
+    }
+
+    elapsed -= stamp;
+    while (elapsed >= period) {
+        elapsed -= period;
+        seconds++;
+    }
+
+    /* us = elapsed * 1e6 / period, done to first order in the period
+       error so it stays in 32 bits: elapsed/16 * (1 - err/F_CPU) */
+    us = elapsed >> 4;
+    err = (int32_t)(period - F_CPU);
+    us -= ((int32_t)us * err) / (int32_t)F_CPU;
+    if (us > 999999UL) {
+        us = 999999UL;
+    }
+
+    t->seconds = seconds;
+    t->micros = us;
+}
+
+ISR(TIMER1_OVF_vect) {
+    timebase_overflows++;
+}
@@ -0,0 +1,62 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Free running 32 bit timebase (Timer1 at F_CPU)
+*/
+
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+/* Edge sources for timebase_mark() */
+#define TIMEBASE_SRC_GPS 0
+#define TIMEBASE_SRC_RTC 1
+
+/* Largest plausible deviation of a second from F_CPU ticks (100 ppm),
+   anything outside is a missed or extra edge. Also keeps the
+   interpolation in timebase_now() within 32 bits. */
+#define TIMEBASE_PERIOD_WINDOW (F_CPU/10000UL)
+
+typedef struct {
+    uint32_t seconds;
+    uint32_t micros;
+} timebase_time_t;
+
+/* Upper 16 bits of the timebase, bumped by the Timer1 overflow */
+volatile uint16_t timebase_overflows;
+
+/* Timebase at the last second edge that drove the clock */
+volatile uint32_t timebase_pps_stamp;
+/* Length of the last good second in CPU ticks (F_CPU nominal) */
+volatile uint32_t timebase_period;
+/* Edges marked since timebase_init() */
+volatile uint32_t timebase_seconds;
+/* TIMEBASE_SRC_* of the last marked edge */
+volatile uint8_t timebase_source;
+
+void timebase_init(void);
+void timebase_mark(uint32_t stamp, uint8_t source);
+void timebase_now(timebase_time_t *t);
+
+/* CPU ticks since timebase_init(), wraps every ~268 s. Inline so ISRs
+   can timestamp events without a call. Safe with interrupts on or
+   off: an overflow that hasn't been serviced yet is accounted for. */
+static inline uint32_t timebase_ticks(void) {
+    uint16_t lo = 0;
+    uint16_t hi = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        lo = TCNT1;
+        hi = timebase_overflows;
+        if ((TIFR1 & (1 << TOV1)) && (lo < 0x8000)) {
+            hi++;
+        }
+    }
+
+    return(((uint32_t)hi << 16) | lo);
+}
+
+#endif
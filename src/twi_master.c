@@ -1,13 +1,34 @@
 //#define F_CPU 16000000
 #include <inttypes.h>
 #include <stdio.h>
-#include <math.h>
 #include <stdlib.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include "twi_master.h"
- 
+#include "tick.h"
+#include "sched.h"
+
+/* Transaction on the bus and the ones waiting for it */
+static TWI_transaction_t * volatile TWI_current = NULL;
+static TWI_transaction_t * volatile TWI_pending[TWI_QUEUE_SIZE];
+static volatile uint8_t TWI_pending_head = 0;
+static volatile uint8_t TWI_pending_tail = 0;
+static volatile uint8_t TWI_pending_count = 0;
+
+/* Current attempt: when it started and how many have failed */
+static volatile uint16_t TWI_started = 0;
+static volatile uint8_t TWI_attempts = 0;
+
+/* Bus recovery, stepped by TWI_tick() one SCL half period per ms */
+#define TWI_REC_IDLE 0
+#define TWI_REC_RELEASE 1 // lines just let go
+#define TWI_REC_SAMPLE 2 // SCL high, look at SDA
+#define TWI_REC_CLOCK 3 // SCL held low
+#define TWI_REC_STOP 4 // START sent, STOP next
+static volatile uint8_t TWI_rec_state = TWI_REC_IDLE;
+static volatile uint8_t TWI_rec_clocks = 0;
  
 /* initialize the Master TWI, uses included parameters from twi_master.h */
 void TWI_init(void) {
@@ -16,65 +37,228 @@ void TWI_init(void) {
     TWCR = (TWI_ACK);
     TWSR = (0<<TWPS1) | (0<<TWPS0); /* no prescaler */
     TWBR = ((F_CPU/SCL_CLOCK) - 16)/2; /* must be > 10 for stable operation */
-    TWI_busy=0;
+    TWI_current = NULL;
+    TWI_pending_head = 0;
+    TWI_pending_tail = 0;
+    TWI_pending_count = 0;
+    TWI_error = TWI_ERR_NONE;
+    TWI_rec_state = TWI_REC_IDLE;
 }
- 
-/* master write to slave */
-void TWI_master_start_write(uint8_t slave_addr, uint16_t write_bytes) {
-    //7 bit slave address, number of bytes to write
-    TWI_busy=1;
-    if(write_bytes>TWI_BUFFER_MAX){
-        TWI_write_bytes=TWI_BUFFER_MAX;
-    }else{
-        TWI_write_bytes=write_bytes;
+
+/* Send STOP and wait (bounded) for it to go out. Returns 1 if the
+   bus never let it through. */
+static uint8_t TWI_stop(void) {
+    uint8_t i = 0;
+
+    TWCR = TWI_STOP; // release the buss
+    while(TWCR & (1<<TWSTO)) { // wait for it
+        if (++i == 0) {
+            return 1;
+        }
     }
-    TWI_operation=TWI_OP_WRITE_ONLY;
-    TWI_master_state = TWI_WRITE_STATE;
-    TWI_target_slave_addr = slave_addr;
-    TWCR = TWI_START; // start TWI master mode
+    return 0;
 }
- 
-/* master read from slave */
-void TWI_master_start_read(uint8_t slave_addr, uint16_t read_bytes){
-    TWI_busy=1;
-    if(read_bytes>TWI_BUFFER_MAX){
-        TWI_read_bytes=TWI_BUFFER_MAX;
-    }else{
-        TWI_read_bytes=read_bytes;
+
+/* Take the pins back from the TWI unit and let go of both lines.
+   TWI_tick() then clocks SCL up to 9 times until the slave lets go of
+   SDA, puts a START/STOP on the bus and hands the pins back. Relies
+   on the external pull-ups. The current transaction waits. */
+static void TWI_recover(void) {
+    TWCR = 0;
+    TWI_PORT &= ~((1 << TWI_SCL) | (1 << TWI_SDA));
+    TWI_DDR &= ~((1 << TWI_SCL) | (1 << TWI_SDA));
+    TWI_rec_clocks = 0;
+    TWI_rec_state = TWI_REC_RELEASE;
+    TWI_recoveries++;
+}
+
+/* (Re)start the current transaction from the top, unless the bus is
+   being recovered (TWI_tick() starts it once it is done) */
+static void TWI_start_current(void) {
+    if (TWI_rec_state != TWI_REC_IDLE) {
+        return;
     }
-    TWI_operation=TWI_OP_READ_ONLY;
-    TWI_master_state = TWI_READ_STATE;
-    TWI_target_slave_addr = slave_addr;
+
+    if ((TWI_current->flags & TWI_FLAG_REG) || TWI_current->write_bytes) {
+        TWI_master_state = TWI_WRITE_STATE;
+    } else {
+        TWI_master_state = TWI_READ_STATE;
+    }
+    TWI_started = tick_ms();
     TWCR = TWI_START; // start TWI master mode
 }
- 
-/* master write then read without releasing buss between */
-void TWI_master_start_write_then_read(uint8_t slave_addr, uint16_t write_bytes, uint16_t read_bytes){
-    TWI_busy=1;
-    if(write_bytes>TWI_BUFFER_MAX){
-        TWI_write_bytes=TWI_BUFFER_MAX;
-    }else{
-        TWI_write_bytes=write_bytes;
+
+/* Put the next queued transaction on the bus. Interrupts must be
+   off (called from the ISR or an atomic block). */
+static void TWI_start_next(void) {
+    if (TWI_pending_count == 0) {
+        TWI_current = NULL;
+        return;
     }
-    if(read_bytes>TWI_BUFFER_MAX){
-        TWI_read_bytes=TWI_BUFFER_MAX;
-    }else{
-        TWI_read_bytes=read_bytes;
+
+    TWI_current = TWI_pending[TWI_pending_tail];
+    TWI_pending_tail = (TWI_pending_tail + 1) % TWI_QUEUE_SIZE;
+    TWI_pending_count--;
+
+    TWI_current->status = TWI_TRANS_ACTIVE;
+    TWI_current->error = TWI_ERR_NONE;
+    TWI_attempts = 0;
+    TWI_start_current();
+}
+
+/* Hand the result back and chain to the next transaction */
+static void TWI_complete(uint8_t status, uint8_t err) {
+    TWI_transaction_t *t = TWI_current;
+
+    t->error = err;
+    t->status = status;
+    if (t->done) {
+        t->done(t);
     }
-    TWI_operation=TWI_OP_WRITE_THEN_READ;
-    TWI_master_state = TWI_WRITE_STATE;
-    TWI_target_slave_addr = slave_addr;
-    TWCR = TWI_START; // start TWI master mode 
+    sched_wake();
+    TWI_start_next();
 }
- 
+
+/* Release the bus after a good transfer */
+static void TWI_finish(void) {
+    if (TWI_stop()) {
+        TWI_recover();
+    }
+    TWI_complete(TWI_TRANS_DONE, TWI_ERR_NONE);
+}
+
+/* The current attempt failed: clean up the bus, then retry or give
+   up. recover forces the 9-clock unstick (after a timeout the TWI
+   unit can't be trusted to release the bus itself). */
+static void TWI_retry(uint8_t err, uint8_t recover) {
+    if (recover || TWI_stop() || !(TWI_PIN & (1 << TWI_SDA))) {
+        TWI_recover();
+    }
+
+    TWI_error = err;
+    if (++TWI_attempts > TWI_RETRIES) {
+        TWI_failures++;
+        TWI_complete(TWI_TRANS_ERROR, err);
+    } else {
+        TWI_start_current();
+    }
+}
+
+/* Queue a transaction, starts it right away if the bus is idle.
+   Returns 0 when queued, 1 when the queue is full. */
+uint8_t TWI_queue(TWI_transaction_t *t) {
+    uint8_t ret = 1;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (TWI_pending_count < TWI_QUEUE_SIZE) {
+            t->status = TWI_TRANS_QUEUED;
+            TWI_pending[TWI_pending_head] = t;
+            TWI_pending_head = (TWI_pending_head + 1) % TWI_QUEUE_SIZE;
+            TWI_pending_count++;
+            if (TWI_current == NULL) {
+                TWI_start_next();
+            }
+            ret = 0;
+        }
+    }
+
+    return(ret);
+}
+
+/* Run from the main loop (and TWI_wait()): abandons an attempt that
+   hasn't finished within TWI_TIMEOUT_MS */
+void TWI_task(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if ((TWI_current != NULL) && (TWI_rec_state == TWI_REC_IDLE) &&
+            (tick_since(TWI_started) > TWI_TIMEOUT_MS)) {
+            TWI_timeouts++;
+            TWI_retry(TWI_ERR_TIMEOUT, 1);
+        }
+    }
+}
+
+/* Called from the 1 kHz tick ISR, runs bus recovery */
+void TWI_tick(void) {
+    switch (TWI_rec_state) {
+    case TWI_REC_IDLE:
+        break;
+    case TWI_REC_RELEASE:
+        TWI_rec_state = TWI_REC_SAMPLE;
+        break;
+    case TWI_REC_CLOCK:
+        TWI_DDR &= ~(1 << TWI_SCL);
+        TWI_rec_clocks++;
+        TWI_rec_state = TWI_REC_SAMPLE;
+        break;
+    case TWI_REC_SAMPLE:
+        if ((TWI_rec_clocks < 9) && !(TWI_PIN & (1 << TWI_SDA))) {
+            /* Slave still holds SDA, give it another clock */
+            TWI_DDR |= (1 << TWI_SCL);
+            TWI_rec_state = TWI_REC_CLOCK;
+        } else {
+            /* SDA low with SCL high: START */
+            TWI_DDR |= (1 << TWI_SDA);
+            TWI_rec_state = TWI_REC_STOP;
+        }
+        break;
+    case TWI_REC_STOP:
+    default:
+        /* SDA back up with SCL high: STOP, the bus is free */
+        TWI_DDR &= ~(1 << TWI_SDA);
+        TWCR = (TWI_ACK);
+        TWI_rec_state = TWI_REC_IDLE;
+        if (TWI_current != NULL) {
+            TWI_start_current();
+        }
+        break;
+    }
+}
+
+/* Wait for a queued transaction. Returns TWI_ERR_NONE when done,
+   otherwise the error it failed with. */
+uint8_t TWI_wait(TWI_transaction_t *t) {
+    while((t->status == TWI_TRANS_QUEUED) || (t->status == TWI_TRANS_ACTIVE)){
+        TWI_task();
+    }
+    /* the ISR filled the caller's buffer behind the compiler's back */
+    __asm__ __volatile__ ("" ::: "memory");
+    return(t->error);
+}
+
+/* Blocking write of len bytes to registers from reg on */
+uint8_t TWI_write_reg(uint8_t slave_addr, uint8_t reg, const uint8_t *buf, uint8_t len) {
+    TWI_transaction_t t;
+
+    t.addr = slave_addr;
+    t.flags = TWI_FLAG_REG;
+    t.reg = reg;
+    t.write_bytes = len;
+    t.read_bytes = 0;
+    t.write_buf = buf;
+    t.read_buf = NULL;
+    t.done = NULL;
+    while(TWI_queue(&t)){
+        TWI_task();
+    }
+
+    return(TWI_wait(&t));
+}
+
 // Routine to service interrupts from the TWI hardware.
 // The most important thing is that this routine runs fast and returns control
 // to the hardware asap. 
 // See pages 229, 232, 235, and 238 of the ATmega328 datasheed for detailed 
 // explaination of the logic below.
 ISR(TWI_vect){
+    TWI_transaction_t *t = TWI_current;
  
     TWI_status = TWSR & TWI_TWSR_status_mask;
+    if (t == NULL) {
+        /* nothing of ours on the bus */
+        TWCR = TWI_ACK;
+        return;
+    }
+
     switch(TWI_status) {
     case TWI_repeated_start_sent:
     case TWI_start_sent:
@@ -82,40 +266,42 @@ ISR(TWI_vect){
         case TWI_WRITE_STATE:
  
             TWI_buffer_pos=0; // point to 1st byte
-            TWDR = (TWI_target_slave_addr<<1) | 0x00; // set SLA_W
+            TWDR = (t->addr<<1) | 0x00; // set SLA_W
             break;
         case TWI_READ_STATE:
             TWI_buffer_pos=0; // point to first byte
-            TWDR = (TWI_target_slave_addr<<1) | 0x01; // set SLA_R
+            TWDR = (t->addr<<1) | 0x01; // set SLA_R
             break;
         }
         TWCR = TWI_ACK; // transmit
         break;
  
-    case TWI_SLA_W_sent_ack_received:   
+    case TWI_SLA_W_sent_ack_received:
+        if (t->flags & TWI_FLAG_REG) {
+            TWDR = t->reg; // register address goes first
+            TWCR = TWI_ENABLE; // transmit
+            break;
+        }
     case TWI_data_sent_ack_received:
  
-        if(TWI_buffer_pos==TWI_write_bytes) {
-            if(TWI_operation==TWI_OP_WRITE_THEN_READ) {
+        if(TWI_buffer_pos==t->write_bytes) {
+            if(t->read_bytes) {
                 TWI_master_state=TWI_READ_STATE; // now read from slave
                 TWCR = TWI_START; // transmit repeated start
             }else{
- 
-                TWCR = TWI_STOP; // release the buss
-                while(TWCR & (1<<TWSTO)); // wait for it
-                TWI_busy=0;
+                TWI_finish();
             }
         } else { 
  
-            TWDR = TWI_buffer_out[TWI_buffer_pos++]; // load data
+            TWDR = t->write_buf[TWI_buffer_pos++]; // load data
             TWCR = TWI_ENABLE; // transmit
         }
         break;
  
     case TWI_data_received_ack_returned:
-        TWI_buffer_in[TWI_buffer_pos++]=TWDR; // save byte
+        t->read_buf[TWI_buffer_pos++]=TWDR; // save byte
     case TWI_SLA_R_sent_ack_received: 
-        if(TWI_buffer_pos==(TWI_read_bytes-1)) {
+        if(TWI_buffer_pos==(t->read_bytes-1)) {
             TWCR = TWI_NACK; // get last byte then nack
         } else {
             TWCR = TWI_ACK; // get next byte then ack
@@ -123,20 +309,20 @@ ISR(TWI_vect){
         break;
  
     case TWI_data_received_nack_returned:            
-        TWI_buffer_in[TWI_buffer_pos++]=TWDR; // save byte
-        TWCR = TWI_STOP; // release the buss
-        while(TWCR & (1<<TWSTO)); // wait for it**
-        TWI_busy=0;
+        t->read_buf[TWI_buffer_pos++]=TWDR; // save byte
+        TWI_finish();
         break;
  
+    case TWI_SLA_W_sent_nack_received:
     case TWI_data_sent_nack_received:
     case TWI_SLA_R_sent_nack_received:
+        TWI_nacks++;
+        TWI_retry(TWI_ERR_NACK, 0);
+        break;
+
     case TWI_arbitration_lost:
     default:
-        TWCR=TWI_STOP; 
-        while(TWCR & (1<<TWSTO)); // wait for it*** 
-        TWCR=TWI_START; // try again
-        TWI_error = 1;
+        TWI_retry(TWI_ERR_BUS, 0);
         break;
     }
  
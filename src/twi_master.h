@@ -22,33 +22,76 @@
 #define TWI_data_received_ack_returned 0x50
 #define TWI_data_received_nack_returned 0x58
 
-#define TWI_BUFFER_MAX 255
-volatile uint8_t TWI_buffer_in[TWI_BUFFER_MAX];
-volatile uint8_t TWI_buffer_out[TWI_BUFFER_MAX];
-volatile uint8_t TWI_target_slave_addr;
-
 volatile uint8_t TWI_status;
 #define TWI_WRITE_STATE 0x01
 #define TWI_READ_STATE 0x02
-volatile uint8_t TWI_operation;
 
 /* call types */
 volatile uint8_t TWI_master_state;
-#define TWI_OP_WRITE_ONLY 0x01
-#define TWI_OP_READ_ONLY 0x02
-#define TWI_OP_WRITE_THEN_READ 0x03
 
 /* control variables */
-volatile uint8_t TWI_operation;
-volatile uint8_t TWI_busy;
-volatile uint8_t TWI_error;
+volatile uint8_t TWI_error; // last TWI_ERR_*
 
 /* buffers and variables */
-//volatile uint16_t TWI_buffer_max;
-volatile uint16_t TWI_buffer_pos;
-//volatile uint8_t TWI_buffer_len;
-volatile uint16_t TWI_read_bytes;
-volatile uint16_t TWI_write_bytes;
+volatile uint8_t TWI_buffer_pos;
+
+/* Transaction status */
+#define TWI_TRANS_IDLE 0x00
+#define TWI_TRANS_QUEUED 0x01
+#define TWI_TRANS_ACTIVE 0x02
+#define TWI_TRANS_DONE 0x03
+#define TWI_TRANS_ERROR 0x04
+
+/* Transaction errors (TWI_transaction_t.error, TWI_wait()) */
+#define TWI_ERR_NONE 0x00
+#define TWI_ERR_NACK 0x01 // slave did not answer
+#define TWI_ERR_TIMEOUT 0x02 // attempt not finished within TWI_TIMEOUT_MS
+#define TWI_ERR_BUS 0x03 // arbitration lost or bus error
+
+/* A stuck transaction is abandoned after this long, then retried up
+   to TWI_RETRIES times. 19 bytes at 400 kHz take ~0.5 ms. */
+#define TWI_TIMEOUT_MS 10
+#define TWI_RETRIES 3
+
+/* SCL/SDA pins, driven by hand to unstick a slave holding SDA */
+#define TWI_PORT PORTD
+#define TWI_DDR DDRD
+#define TWI_PIN PIND
+#define TWI_SCL PD0
+#define TWI_SDA PD1
+
+/* Fault counters */
+volatile uint16_t TWI_nacks;
+volatile uint16_t TWI_timeouts;
+volatile uint16_t TWI_recoveries;
+volatile uint16_t TWI_failures;
+
+/* Transaction flags */
+#define TWI_FLAG_REG 0x01 // send reg before write_buf
+
+/* Transactions waiting for the bus */
+#define TWI_QUEUE_SIZE 4
+
+/* A transaction writes reg (with TWI_FLAG_REG) and write_bytes from
+   write_buf, then (repeated start) reads read_bytes into read_buf.
+   Either length may be 0. The descriptor and buffers belong to the
+   caller and must stay put until status is DONE or ERROR. done is
+   called from the TWI ISR. */
+typedef struct TWI_transaction TWI_transaction_t;
+typedef void (*TWI_callback_t)(TWI_transaction_t *);
+
+struct TWI_transaction {
+    uint8_t addr;
+    uint8_t flags;
+    uint8_t reg;
+    uint8_t write_bytes;
+    uint8_t read_bytes;
+    const volatile uint8_t *write_buf;
+    volatile uint8_t *read_buf;
+    TWI_callback_t done;
+    volatile uint8_t status;
+    volatile uint8_t error;
+};
 
 #define TWI_ENABLE _BV(TWEN) | _BV(TWINT) | _BV(TWIE)
 #define TWI_ACK _BV(TWEA) | TWI_ENABLE
@@ -57,9 +100,11 @@ volatile uint16_t TWI_write_bytes;
 #define TWI_STOP _BV(TWSTO) | TWI_ENABLE
 
 void TWI_init(void);
-void TWI_master_start_write(uint8_t slave_addr, uint16_t write_bytes);
-void TWI_master_start_read(uint8_t slave_addr, uint16_t read_bytes);
-void TWI_master_start_write_then_read(uint8_t slave_addr, uint16_t write_bytes, uint16_t read_bytes);
+uint8_t TWI_queue(TWI_transaction_t *t);
+uint8_t TWI_wait(TWI_transaction_t *t);
+void TWI_task(void);
+void TWI_tick(void);
+uint8_t TWI_write_reg(uint8_t slave_addr, uint8_t reg, const uint8_t *buf, uint8_t len);
 
 #endif
 
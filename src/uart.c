@@ -4,41 +4,88 @@
    UART interface
 */
 
+#include <string.h>
+#include <util/atomic.h>
 #include "uart.h"
 #include "nmea.h"
+#include "timebase.h"
+#include "sched.h"
+
+#define UART_TX_MASK (UART_TX_BUFFER_SIZE - 1)
 
 static uint8_t uart_receive(void);
 
+/* Slot the ISR is filling and the next slot the main loop reads */
+static volatile uint8_t rx_fill = 0;
+static uint8_t rx_read = 0;
+/* Position in the slot being filled, 0 while hunting for '$' */
+static volatile uint8_t rx_pos = 0;
+
+/* TX ring, head written by the main loop, tail by the ISR */
+static uint8_t tx_buf[UART_TX_BUFFER_SIZE];
+static volatile uint8_t tx_head = 0;
+static volatile uint8_t tx_tail = 0;
+
+static inline uint8_t rx_next(uint8_t slot) {
+    return((slot == (UART_RX_SLOTS - 1)) ? 0 : slot + 1);
+}
+
 /* Initialize interface */
 void uart_init(uint32_t baud) {
-    uint16_t ubrr_val = ((F_CPU/(baud*16UL)) - 1);
+    /* Double speed with a rounded divisor, 115200 is 8.5% off in
+       normal mode at 16 MHz but only 2.1% with U2X */
+    uint16_t ubrr_val = (((F_CPU + baud*4UL)/(baud*8UL)) - 1);
     UBRR1H = (ubrr_val >> 8);
     UBRR1L = ubrr_val;
+    UCSR1A = (1 << U2X1);
 
     // 8 bit, 1 stop bit, no parity
     UCSR1C |= (1 << UCSZ10) | (1 << UCSZ11);
     UCSR1B |= (1 << RXEN1) | (1 << TXEN1);
 
     uart_rx_overflow = 0;
+    tx_head = 0;
+    tx_tail = 0;
+    uart_tx_busy = 0;
 
     /* Enable uart RX complete interrupt */
     UCSR1B |= (1 << RXCIE1);
 }
 
-/* Initialize the uart RX buffer. Run before uart_init() */
+/* Initialize the uart RX sentence slots. Run before uart_init() */
 void uart_init_buffer(void) {
-    /* Create ring buffer for uart rx */
-    RingBuffer_InitBuffer(&uart_buf, uart_buf_data, sizeof(uart_buf_data));
+    uart_flush_buffer();
 }
 
-/* Completely clear the uart RX buffer. */
+/* Completely clear the uart RX slots. Only call with the RX interrupt
+   off (uart_disable()) or before uart_init(). */
 void uart_flush_buffer(void) {
-    while(!RingBuffer_IsEmpty(&uart_buf)) {
-        RingBuffer_Remove(&uart_buf);
+    uint8_t i = 0;
+
+    for (i = 0; i < UART_RX_SLOTS; i++) {
+        uart_rx_len[i] = 0;
+    }
+    rx_fill = 0;
+    rx_read = 0;
+    rx_pos = 0;
+}
+
+/* Number of complete sentences waiting for the main loop */
+uint8_t uart_rx_pending(void) {
+    uint8_t i = 0;
+    uint8_t n = 0;
+
+    for (i = 0; i < UART_RX_SLOTS; i++) {
+        if (uart_rx_len[i]) {
+            n++;
+        }
     }
+
+    return n;
 }
 
-/* Disable uart and interrupt */
+/* Disable uart and interrupt. Anything still in the TX buffer is
+   lost, use uart_tx_flush() first if it matters. */
 void uart_disable(void) {
     /* Disable uart RX complete interrupt */
     UCSR1B &= ~(1 << RXCIE1);
@@ -49,20 +96,56 @@ void uart_disable(void) {
 
     UBRR1H = 0x00;
     UBRR1L = 0x00;
+
+    tx_head = 0;
+    tx_tail = 0;
+    uart_tx_busy = 0;
 }
-    
-void uart_send_string(char* str) {
-    uint8_t i = 0;
 
-    for (i = 0; str[i] != 0; i++) {
-        uart_transmit(str[i]);
+/* Queue up to len bytes for transmission without blocking. Returns
+   the number of bytes actually queued. */
+uint8_t uart_send(const uint8_t *data, uint8_t len) {
+    uint8_t n = 0;
+    uint8_t head = tx_head;
+    uint8_t next = 0;
+
+    while (n < len) {
+        next = (head + 1) & UART_TX_MASK;
+        if (next == tx_tail) {
+            /* full */
+            break;
+        }
+        tx_buf[head] = data[n++];
+        head = next;
+    }
+
+    if (n) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            tx_head = head;
+            uart_tx_busy = 1;
+            /* UDRE interrupt drains the buffer, TX complete is only
+               armed once the last byte is in UDR */
+            UCSR1B = (UCSR1B & ~(1 << TXCIE1)) | (1 << UDRIE1);
+        }
     }
+
+    return n;
 }
 
-/* transmit a byte */
+/* Queue a string, returns the number of bytes queued */
+uint8_t uart_send_string(const char* str) {
+    return uart_send((const uint8_t *)str, strlen(str));
+}
+
+/* Queue a byte, waits only if the TX buffer is full */
 void uart_transmit(uint8_t byte) {
-    while (!(UCSR1A & (1 << UDRE1)));
-    UDR1 = byte;
+    while (!uart_send(&byte, 1));
+}
+
+/* Block until everything queued has left the shift register (before
+   changing baud rate for example). */
+void uart_tx_flush(void) {
+    while (uart_tx_busy);
 }
 
 /* don't use... */
@@ -71,24 +154,78 @@ uint8_t uart_receive(void) {
     return UDR1;
 }
 
-/* Must be called frequently in main loop! */
+/* Must be called frequently in main loop! Parses complete sentences
+   in place and hands their slots back to the ISR. */
 void uart_task(void) {
-    if (RingBuffer_IsEmpty(&uart_buf)) {
+    uint8_t len = 0;
+
+    while ((len = uart_rx_len[rx_read]) != 0) {
+        nmea_parse_sentence(uart_rx_slot[rx_read], len, uart_rx_stamp[rx_read]);
+        uart_rx_bytes += len;
+        uart_rx_len[rx_read] = 0;
+        rx_read = rx_next(rx_read);
+    }
+}
+
+ISR(USART1_UDRE_vect) {
+    uint8_t tail = tx_tail;
+
+    if (tail == tx_head) {
+        UCSR1B = (UCSR1B & ~(1 << UDRIE1)) | (1 << TXCIE1);
         return;
-    } else {
-        /* Try and get NMEA stuff out of the buffer */
-        nmea_parse();
     }
+
+    /* Clear a stale TX complete flag so it only fires for this byte */
+    UCSR1A = (UCSR1A & ((1 << U2X1) | (1 << MPCM1))) | (1 << TXC1);
+    UDR1 = tx_buf[tail];
+    tail = (tail + 1) & UART_TX_MASK;
+    tx_tail = tail;
+
+    if (tail == tx_head) {
+        /* Last byte is in UDR, wait for it to shift out */
+        UCSR1B = (UCSR1B & ~(1 << UDRIE1)) | (1 << TXCIE1);
+    }
+}
+
+ISR(USART1_TX_vect) {
+    UCSR1B &= ~(1 << TXCIE1);
+    uart_tx_busy = 0;
 }
 
 ISR(USART1_RX_vect) {
     uint8_t rx_byte = 0x00;
+    uint8_t pos = rx_pos;
+    uint8_t slot = rx_fill;
+
     rx_byte = UDR1;
-    if (RingBuffer_IsFull(&uart_buf)) {
-        /* overflow... no data sent along */
-        uart_rx_overflow++;
-    } else {
-        RingBuffer_Insert(&uart_buf, rx_byte);
+
+    if (rx_byte == '$') {
+        if (uart_rx_len[slot]) {
+            /* main loop still owns it, drop this sentence */
+            uart_rx_overflow++;
+            pos = 0;
+        } else {
+            uart_rx_stamp[slot] = timebase_ticks();
+            uart_rx_slot[slot][0] = rx_byte;
+            pos = 1;
+        }
+    } else if (pos) {
+        if (pos < UART_RX_SLOT_SIZE) {
+            uart_rx_slot[slot][pos++] = rx_byte;
+            if (rx_byte == '\n') {
+                /* publish and move on */
+                uart_rx_len[slot] = pos;
+                rx_fill = rx_next(slot);
+                pos = 0;
+                sched_wake();
+            }
+        } else {
+            /* no terminator, throw it away */
+            uart_rx_overflow++;
+            pos = 0;
+        }
     }
+
+    rx_pos = pos;
 }
 
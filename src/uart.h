@@ -6,20 +6,43 @@
 #ifndef _UART_H_
 #define _UART_H_
 
-#include <LUFA/Drivers/Misc/RingBuffer.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
 
-#define NIX_UART_BUFFER_SIZE 128
+/* The RX interrupt assembles whole NMEA sentences ('$' through '\n')
+   straight into a small pool of slots. A slot with a non-zero length
+   is complete and belongs to the main loop until it is released, so
+   the slot lengths double as a lock-free single producer/single
+   consumer queue. Slots are filled and drained in order. */
+#define UART_RX_SLOTS 3
+#define UART_RX_SLOT_SIZE 82
 
-RingBuffer_t uart_buf;
-uint8_t uart_buf_data[NIX_UART_BUFFER_SIZE];
+uint8_t uart_rx_slot[UART_RX_SLOTS][UART_RX_SLOT_SIZE];
+volatile uint8_t uart_rx_len[UART_RX_SLOTS];
+/* timebase_ticks() when the '$' of each slot arrived */
+uint32_t uart_rx_stamp[UART_RX_SLOTS];
+/* sentences dropped because no slot was free or they were too long */
 volatile uint8_t uart_rx_overflow;
+/* bytes of complete sentences handed to the parser (wraps) */
+uint16_t uart_rx_bytes;
+
+/* TX ring buffer drained by the data register empty interrupt. Must
+   be a power of two. */
+#define UART_TX_BUFFER_SIZE 64
+
+/* Set while anything is queued or still shifting out, cleared by the
+   TX complete interrupt once the line is idle */
+volatile uint8_t uart_tx_busy;
 
 void uart_init(uint32_t baud);
 void uart_init_buffer(void);
 void uart_flush_buffer(void);
 void uart_disable(void);
 void uart_transmit(uint8_t byte);
-void uart_send_string(char* str);
+uint8_t uart_send(const uint8_t *data, uint8_t len);
+uint8_t uart_send_string(const char* str);
+void uart_tx_flush(void);
+uint8_t uart_rx_pending(void);
 void uart_task(void);
 
 #endif